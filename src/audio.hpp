@@ -27,7 +27,7 @@ namespace light::audio
     pa_sample_spec ss;
     unsigned int rate;
   public:
-    Audio() : inited(false), rate(0) {};
+    Audio() : inited(false), s(nullptr), rate(0) {};
   
     Audio(const Audio &b) = delete;
   
@@ -53,6 +53,10 @@ namespace light::audio
     
     void set_server(const std::string &server_) { server = server_; }
     
+    bool is_inited() const { return inited; }
+    
+    unsigned int get_samplerate() const { return rate; }
+    
     void init(pa_sample_spec ss = {.format = PA_SAMPLE_S16LE,
         .rate = 44100,
         .channels = 2})
@@ -104,6 +108,12 @@ namespace light::audio
       }
     }
   
+    // Drops what PulseAudio has not played yet.
+    void flush()
+    {
+      if (s) pa_simple_flush(s, NULL);
+    }
+  
   private:
     void default_init()
     {
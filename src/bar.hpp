@@ -22,6 +22,7 @@
 #include <condition_variable>
 #include <mutex>
 #include <future>
+#include <functional>
 
 namespace light::bar
 {
@@ -97,6 +98,8 @@ namespace light::bar
     unsigned int time;
     std::thread th;
     std::atomic<bool> paused;
+    std::mutex pause_mutex;
+    std::condition_variable pause_cond;
     std::atomic<double> offset;
   public:
     TimeBar(term::TermPos pos_) : Bar(pos_), time(0), paused(false), offset(0) {}
@@ -135,15 +138,25 @@ namespace light::bar
       return *this;
     }
     
-    TimeBar &start(unsigned int pos = 0)
+    // The bar of the previous track keeps running until that track ends,
+    // then on_start is called and this one takes over.
+    TimeBar &start(unsigned int pos = 0, std::function<void()> on_start = nullptr)
     {
+      auto prev = std::move(th);
       th = std::thread
-          ([this, pos]
+          ([this, pos, on_start = std::move(on_start), info = std::move(info), prev = std::move(prev)]() mutable
            {
+             if (prev.joinable())
+             {
+               prev.join();
+             }
+             if (!light_is_running) return;
+             reset();
+             offset = 0;
+             if (on_start) on_start();
              if (info != nullptr)
              {
                time = info->get_future().get().time;
-               info = nullptr;
              }
   
              auto begin = std::chrono::steady_clock::now() - std::chrono::milliseconds(pos);
@@ -164,9 +177,9 @@ namespace light::bar
                if (paused)
                {
                  auto b = std::chrono::steady_clock::now();
-                 while (paused)
                  {
-                   std::this_thread::yield();
+                   std::unique_lock<std::mutex> lock(pause_mutex);
+                   pause_cond.wait(lock, [this] { return !paused || !light_is_running; });
                  }
                  std::chrono::duration<double, std::milli> s = std::chrono::steady_clock::now() - b;
                  offset = offset + s.count();
@@ -184,13 +197,18 @@ namespace light::bar
     
     TimeBar &pause()
     {
+      std::lock_guard<std::mutex> lock(pause_mutex);
       paused = true;
       return *this;
     }
     
     TimeBar &go()
     {
-      paused = false;
+      {
+        std::lock_guard<std::mutex> lock(pause_mutex);
+        paused = false;
+      }
+      pause_cond.notify_all();
       return *this;
     }
   
@@ -203,15 +221,15 @@ namespace light::bar
       return *this;
     }
   
-    TimeBar &rewind()
+    TimeBar &rewind(double ms = 5000)
     {
-      offset = offset + 5000;
+      offset = offset + ms;
       return *this;
     }
   
-    TimeBar &skip()
+    TimeBar &skip(double ms = 5000)
     {
-      offset = offset - 5000;
+      offset = offset - ms;
       return *this;
     }
   };
@@ -0,0 +1,387 @@
+//   Copyright 2022 light - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef LIGHT_CACHE_HPP
+#define LIGHT_CACHE_HPP
+
+#include "http.hpp"
+#include "index.hpp"
+#include "stream.hpp"
+#include "logger.hpp"
+
+#include <string>
+#include <memory>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <filesystem>
+#include <cstdint>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace light::cache
+{
+  // Online songs kept in one directory, each file named by the hash of its
+  // URL. The index remembers when each entry was last played and checked
+  // and what the server said identifies its version, so an entry checked
+  // within a day costs no request and an older one a conditional HEAD.
+  // The least recently played entries go once the total is over the cap.
+  //
+  // A song not in the cache is played while it downloads, and copied into
+  // the cache file on the way. What the player did not read is downloaded
+  // in the background afterwards, and then the file joins the cache.
+  // sync() downloads a song in full instead, for filling the cache ahead.
+  class Cache : public std::enable_shared_from_this<Cache>
+  {
+  private:
+    static constexpr int64_t fresh_seconds = 24 * 60 * 60;
+    static constexpr char magic[] = "light-cache 1";
+
+    struct Entry
+    {
+      std::string url;
+      uint64_t size;
+      int64_t used;
+      int64_t validated;
+      std::string etag;
+      std::string last_modified;
+    };
+
+    std::string dir;
+    uint64_t capacity;
+    std::mutex mtx;
+    std::map<std::string, Entry> entries;
+    std::atomic<std::size_t> downloads;
+  public:
+    Cache(const std::string &dir_, uint64_t capacity_) : dir(dir_), capacity(capacity_), downloads(0)
+    {
+      std::error_code ec;
+      std::filesystem::create_directories(dir, ec);
+      load();
+    }
+
+    Cache(const Cache &) = delete;
+
+    // 0 for no cap.
+    void set_capacity(uint64_t bytes)
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      capacity = bytes;
+      evict("");
+      save();
+    }
+
+    // Opens an up to date copy of `url`, or streams it with `window` and
+    // `spill` as in NetInputStream. What is left to download afterwards
+    // goes over up to `connections` connections.
+    std::shared_ptr<stream::InputStream> open(const std::string &url, unsigned int connections,
+                                              std::size_t window, bool spill)
+    {
+      auto key = key_of(url);
+      auto path = dir + "/" + key;
+      Entry entry;
+      std::size_t size = 0;
+      if (check(url, key, entry, size))
+      {
+        return std::make_shared<stream::MappedInputStream>(path);
+      }
+      auto tmp = path + ".part" + std::to_string(downloads++);
+      auto tee = std::make_shared<stream::TeeFile>(tmp);
+      return http::open_stream(url, window, spill, tee,
+                               [self = shared_from_this(), url, key, tmp, tee, entry, size, connections]
+                                   (std::size_t streamed) mutable
+                               {
+                                 entry.size = streamed != 0 ? streamed : size;
+                                 if (entry.size == 0)
+                                 {
+                                   // Nothing tells whether it is complete.
+                                   std::remove(tmp.c_str());
+                                   return;
+                                 }
+                                 http::fill(url, tee, tee->missing(entry.size), connections,
+                                            [self, key, tmp, tee, entry] { self->commit(key, tmp, *tee, entry); });
+                               });
+    }
+
+    // Downloads `url` into the cache unless it is there and up to date, at
+    // most `speed` bytes per second, 0 for no limit. A download cut short is
+    // resumed the next time if the server still has the same version.
+    // Returns whether the cache has it now.
+    bool sync(const std::string &url, std::size_t speed, const http::Http::Progress &progress)
+    {
+      auto key = key_of(url);
+      auto path = dir + "/" + key;
+      Entry entry;
+      std::size_t size = 0;
+      auto part = path + ".sync";
+      auto meta = part + ".meta";
+      if (check(url, key, entry, size))
+      {
+        std::remove(part.c_str());
+        std::remove(meta.c_str());
+        return true;
+      }
+
+      auto version = entry.etag.empty() ? entry.last_modified : entry.etag;
+      std::size_t have = 0;
+      {
+        std::ifstream fs(meta);
+        std::string u, v;
+        std::error_code ec;
+        if (std::getline(fs, u) && std::getline(fs, v) && u == url && v == version && !version.empty() && size != 0)
+        {
+          have = std::filesystem::file_size(part, ec);
+          if (ec || have > size) have = 0;
+        }
+      }
+      {
+        std::ofstream fs(meta, std::ios::trunc);
+        fs << url << '\n' << version << '\n';
+      }
+      int fd = ::open(part.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      if (fd == -1) return false;
+      bool ok = size != 0 && have == size;
+      bool refused = false;
+      entry.size = size;
+      // A server that no longer has the same version sends all of it.
+      for (int attempt = 0; attempt < 2 && !ok && light_is_running; ++attempt)
+      {
+        if (attempt != 0 || have == 0)
+        {
+          have = 0;
+          if (ftruncate(fd, 0) != 0) break;
+        }
+        http::Http h(url);
+        h.set_speed_limit(speed).set_progress(progress).set_file_from(fd, have);
+        if (have != 0)
+        {
+          h.add_header("If-Range: " + version);
+        }
+        try
+        {
+          h.get();
+        }
+        catch (logger::Error &) {}
+        auto &range = h.response.file_range();
+        refused = range.refused;
+        ok = !refused && h.response_code / 100 == 2 && (size == 0 || range.offset == size);
+        entry.size = range.offset;
+        if (have == 0 || !refused) break;
+      }
+      close(fd);
+      if (!ok)
+      {
+        // What is there can only be resumed against the same version.
+        if (version.empty() || refused)
+        {
+          std::remove(part.c_str());
+          std::remove(meta.c_str());
+        }
+        return false;
+      }
+      std::remove(meta.c_str());
+      return add(key, part, entry);
+    }
+
+  private:
+    // Whether the copy of `url` is there and up to date, asking the server
+    // if it was not checked recently. A copy the server does not answer for
+    // counts as up to date. If not, `entry` is what a new copy
+    // gets and `size` what the server said, 0 if unknown.
+    bool check(const std::string &url, const std::string &key, Entry &entry, std::size_t &size)
+    {
+      auto path = dir + "/" + key;
+      auto now = std::chrono::duration_cast<std::chrono::seconds>(
+          std::chrono::system_clock::now().time_since_epoch()).count();
+      bool found = false;
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (auto it = entries.find(key); it != entries.end() && it->second.url == url
+                                         && std::filesystem::exists(path))
+        {
+          entry = it->second;
+          found = true;
+          if (now - entry.validated < fresh_seconds)
+          {
+            it->second.used = now;
+            save();
+            return true;
+          }
+        }
+      }
+
+      http::Http h(url);
+      if (found && !entry.etag.empty())
+      {
+        h.add_header("If-None-Match: " + entry.etag);
+      }
+      if (found && !entry.last_modified.empty())
+      {
+        h.add_header("If-Modified-Since: " + entry.last_modified);
+      }
+      size = 0;
+      try
+      {
+        size = h.head();
+      }
+      catch (logger::Error &) {}
+      if (found && h.response_code != 200)
+      {
+        // Without an answer the copy is still the best there is, but it
+        // stays unchecked so that the next open asks again.
+        std::lock_guard<std::mutex> lock(mtx);
+        if (auto it = entries.find(key); it != entries.end())
+        {
+          it->second.used = now;
+          if (h.response_code == 304) it->second.validated = now;
+          save();
+        }
+        return true;
+      }
+      entry = Entry{url, 0, now, now, "", ""};
+      if (h.response_code == 200)
+      {
+        entry.etag = h.response.etag;
+        entry.last_modified = h.response.last_modified;
+      }
+      else
+      {
+        size = 0;
+      }
+      return false;
+    }
+
+    void commit(const std::string &key, const std::string &tmp, stream::TeeFile &tee, const Entry &entry)
+    {
+      if (!tee.missing(entry.size).empty())
+      {
+        std::remove(tmp.c_str());
+        return;
+      }
+      std::error_code ec;
+      std::filesystem::resize_file(tmp, entry.size, ec);
+      add(key, tmp, entry);
+    }
+
+    // Moves the complete file `tmp` into the cache.
+    bool add(const std::string &key, const std::string &tmp, const Entry &entry)
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      std::error_code ec;
+      std::filesystem::rename(tmp, dir + "/" + key, ec);
+      if (ec)
+      {
+        std::remove(tmp.c_str());
+        return false;
+      }
+      entries[key] = entry;
+      evict(key);
+      save();
+      return true;
+    }
+
+    static std::string key_of(const std::string &url)
+    {
+      char name[17];
+      snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(index::fnv1a(url)));
+      return name;
+    }
+
+    // Called with the mutex held, `keep` is never removed.
+    void evict(const std::string &keep)
+    {
+      if (capacity == 0) return;
+      uint64_t total = 0;
+      for (auto &[key, entry]: entries)
+      {
+        total += entry.size;
+      }
+      while (total > capacity)
+      {
+        auto victim = entries.end();
+        for (auto it = entries.begin(); it != entries.end(); ++it)
+        {
+          if (it->first != keep && (victim == entries.end() || it->second.used < victim->second.used))
+          {
+            victim = it;
+          }
+        }
+        if (victim == entries.end()) break;
+        std::remove((dir + "/" + victim->first).c_str());
+        total -= victim->second.size;
+        entries.erase(victim);
+      }
+    }
+
+    void load()
+    {
+      // Left by downloads that never finished.
+      std::error_code ec;
+      for (auto &file: std::filesystem::directory_iterator(dir, ec))
+      {
+        auto name = file.path().filename().string();
+        if (name.size() > 21 && name.compare(16, 5, ".part") == 0)
+        {
+          std::filesystem::remove(file.path(), ec);
+        }
+      }
+
+      std::ifstream fs(dir + "/index");
+      std::string line;
+      if (!std::getline(fs, line) || line != magic) return;
+      while (std::getline(fs, line))
+      {
+        std::istringstream ss(line);
+        std::string key, size, used, validated;
+        Entry entry;
+        if (!std::getline(ss, key, '\t') || !std::getline(ss, size, '\t') || !std::getline(ss, used, '\t')
+            || !std::getline(ss, validated, '\t') || !std::getline(ss, entry.etag, '\t')
+            || !std::getline(ss, entry.last_modified, '\t') || !std::getline(ss, entry.url))
+        {
+          continue;
+        }
+        if (!std::filesystem::exists(dir + "/" + key)) continue;
+        entry.size = std::strtoull(size.c_str(), nullptr, 10);
+        entry.used = std::strtoll(used.c_str(), nullptr, 10);
+        entry.validated = std::strtoll(validated.c_str(), nullptr, 10);
+        entries[key] = std::move(entry);
+      }
+    }
+
+    // Called with the mutex held.
+    void save()
+    {
+      auto path = dir + "/index";
+      auto tmp = path + ".tmp";
+      {
+        std::ofstream fs(tmp, std::ios::trunc);
+        if (!fs.is_open()) return;
+        fs << magic << '\n';
+        for (auto &[key, entry]: entries)
+        {
+          fs << key << '\t' << entry.size << '\t' << entry.used << '\t' << entry.validated << '\t'
+             << entry.etag << '\t' << entry.last_modified << '\t' << entry.url << '\n';
+        }
+        if (!fs) return;
+      }
+      std::error_code ec;
+      std::filesystem::rename(tmp, path, ec);
+    }
+  };
+}
+#endif
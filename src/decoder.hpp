@@ -16,7 +16,9 @@
 
 #include "bar.hpp"
 #include "encoder.hpp"
+#include "pcm.hpp"
 #include "stream.hpp"
+#include "index.hpp"
 #include "logger.hpp"
 #include "utils.hpp"
 
@@ -28,6 +30,12 @@
 #include <string>
 #include <memory>
 #include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <optional>
+#include <algorithm>
 
 namespace light::decoder
 {
@@ -41,74 +49,131 @@ namespace light::decoder
     return time * 8192 / ((8192 * 8) / (bitrate / 1000));
   }
   
+  // Samples of delay added by the synthesis filter of every MPEG audio
+  // decoder, on top of the encoder delay stored in the LAME header.
+  constexpr unsigned int decoder_delay = 529;
+  
+  struct SeekRequest
+  {
+    // Relative requests move `delta` bytes from the current frame.
+    bool relative;
+    long delta;
+    uint64_t offset;
+    uint64_t sample;
+    // Frames before this sample only prime the decoder and are not output.
+    uint64_t target;
+  };
+  
   struct Data
   {
     utils::MusicInfo decoder_info;
     std::shared_ptr<std::promise<utils::MusicInfo>> info;
     std::shared_ptr<stream::InputStream> input_stream;
     std::shared_ptr<encoder::EncodeStream> encode_stream;
-    std::array<unsigned char, LIGHT_AUDIO_READ_BUFFER_SIZE> decoder_buffer;
+    std::array<unsigned char, LIGHT_AUDIO_READ_BUFFER_SIZE + MAD_BUFFER_GUARD> decoder_buffer;
+    // Large enough for any frame libmad synthesizes, reused for every frame.
+    alignas(32) std::array<short, sizeof(mad_pcm::samples) / sizeof(mad_fixed_t)> pcm_buffer;
     
-    std::atomic<bool> pause;
+    std::atomic<bool> pause{false};
+    std::mutex pause_mutex;
+    std::condition_variable pause_cond;
+    
+    mpeg::Probe probe;
+    struct mad_stream *stream;
+    std::shared_future<index::SeekIndex> seek_index;
+    std::mutex seek_mutex;
+    SeekRequest seek_request;
+    std::atomic<bool> seeking;
+    uint64_t next_sample;
+    uint64_t frame_sample;
+    uint64_t discard_until;
+    std::atomic<uint64_t> position;
+    // With gapless playback only the samples in [trim_begin, trim_end) are
+    // output, which drops the encoder delay and padding.
+    bool gapless = false;
+    uint64_t trim_begin;
+    uint64_t trim_end;
   };
   
-  short scale(mad_fixed_t sample)
+  void append_pcm(std::vector<short> &output, const struct mad_pcm *pcm)
   {
-    sample += (1L << (MAD_F_FRACBITS - 16));
-    if (sample >= MAD_F_ONE)
-    {
-      sample = MAD_F_ONE - 1;
-    }
-    else if (sample < -MAD_F_ONE)
-    {
-      sample = -MAD_F_ONE;
-    }
-    return sample >> (MAD_F_FRACBITS + 1 - 16);
+    auto pos = output.size();
+    output.resize(pos + static_cast<std::size_t>(pcm->length) * pcm->channels);
+    pcm::convert(pcm, output.data() + pos);
   }
   
   enum mad_flow output(void *data, struct mad_header const *header, struct mad_pcm *pcm)
   {
     Data *d = (Data *) data;
-    unsigned int nchannels, nsamples, i;
-    const mad_fixed_t *channel[2];
-    std::vector<short> output;
-    output.reserve(8192);
-    short sample;
-    nchannels = pcm->channels;
-    nsamples = pcm->length;
-    for (i = 0; i < nchannels; i++)
+    uint64_t begin = std::max({d->frame_sample, d->discard_until, d->trim_begin});
+    uint64_t end = std::min<uint64_t>(d->frame_sample + pcm->length, d->trim_end);
+    if (begin >= end)
     {
-      channel[i] = pcm->samples[i];
+      return MAD_FLOW_CONTINUE;
     }
-    while (nsamples--)
-    {
-      for (i = 0; i < nchannels; i++)
-      {
-        sample = scale(*channel[i]++);
-        output.emplace_back(sample);
-      }
-    }
-    d->encode_stream->write(&output[0], output.size() * sizeof(short));
+    pcm::convert(pcm, d->pcm_buffer.data());
+    d->encode_stream->write(d->pcm_buffer.data() + (begin - d->frame_sample) * pcm->channels,
+                            (end - begin) * pcm->channels * sizeof(short));
     return MAD_FLOW_CONTINUE;
   }
   
   enum mad_flow input(void *data, struct mad_stream *stream)
   {
     Data *d = (Data *) data;
-    if (d->input_stream->eof())
+    d->stream = stream;
+    auto map = d->input_stream->data();
+    std::size_t bytes = 0;
+    std::size_t length = 0;
+    if (d->seeking)
+    {
+      std::lock_guard<std::mutex> lock(d->seek_mutex);
+      auto req = d->seek_request;
+      if (req.relative)
+      {
+        long cur = d->input_stream->read_size();
+        if (stream->this_frame != NULL)
+        {
+          // header() has dropped the rest of the buffer, this_frame is still
+          // the frame that was playing.
+          cur = map != nullptr ? stream->this_frame - map : cur - (stream->bufend - stream->this_frame);
+        }
+        req.offset = std::max(0L, cur + req.delta);
+      }
+      d->input_stream->seek(req.offset);
+      d->encode_stream->flush();
+      d->next_sample = req.sample;
+      d->discard_until = req.target;
+      // The bit reservoir belongs to the old position.
+      stream->md_len = 0;
+      d->seeking = false;
+    }
+    else if (d->input_stream->eof())
     {
       return MAD_FLOW_STOP;
     }
-    std::size_t bytes = 0;
-    std::size_t length = 0;
-    if (stream->next_frame != NULL)
+    else if (map == nullptr && stream->next_frame != NULL)
     {
       bytes = stream->bufend - stream->next_frame;
-      memcpy(d->decoder_buffer.data(), stream->next_frame, bytes);
+      memmove(d->decoder_buffer.data(), stream->next_frame, bytes);
+    }
+    // A mapped file is decoded in place, the zeros after it are the guard.
+    if (map != nullptr)
+    {
+      auto pos = d->input_stream->read_size();
+      auto size = d->input_stream->size();
+      mad_stream_buffer(stream, map + pos, size - pos + MAD_BUFFER_GUARD);
+      d->input_stream->seek(size);
+      return MAD_FLOW_CONTINUE;
     }
     length = d->input_stream->read
         (d->decoder_buffer.data() + bytes,
          LIGHT_AUDIO_READ_BUFFER_SIZE - bytes);
+    // libmad needs MAD_BUFFER_GUARD bytes after the last frame to decode it.
+    if (d->input_stream->eof())
+    {
+      memset(d->decoder_buffer.data() + bytes + length, 0, MAD_BUFFER_GUARD);
+      length += MAD_BUFFER_GUARD;
+    }
     mad_stream_buffer(stream, d->decoder_buffer.data(), length + bytes);
     return MAD_FLOW_CONTINUE;
   }
@@ -118,23 +183,45 @@ namespace light::decoder
     Data *d = (Data *) data;
     if (d->info != nullptr)
     {
-      utils::MusicInfo info{
-          .time = static_cast<unsigned int>((d->input_stream->size() / 8192) * ((8192 * 8) / (header->bitrate / 1000))),
-          .samplerate = header->samplerate,
-          .bitrate = header->bitrate,
-          .channels = 2,
-          .size = d->input_stream->size()
-      };
+      utils::MusicInfo info;
+      if (d->probe.found)
+      {
+        info = mpeg::to_info(d->probe, d->input_stream->size());
+      }
+      else
+      {
+        info = utils::MusicInfo{
+            .time = static_cast<unsigned int>((d->input_stream->size() / 8192) * ((8192 * 8) / (header->bitrate / 1000))),
+            .samplerate = header->samplerate,
+            .bitrate = header->bitrate,
+            .channels = 2,
+            .size = d->input_stream->size()
+        };
+      }
       d->decoder_info = info;
+      if (auto net = dynamic_cast<stream::NetInputStream *>(d->input_stream.get()); net != nullptr)
+      {
+        net->set_bitrate(info.bitrate);
+      }
       d->encode_stream->set_info(info);
       d->info->set_value(info);
       d->info = nullptr;
     }
-    while (d->pause)
+    if (d->pause)
     {
-      std::this_thread::yield();
+      std::unique_lock<std::mutex> lock(d->pause_mutex);
+      d->pause_cond.wait(lock, [d] { return !d->pause || !light_is_running; });
     }
     if (!light_is_running) return MAD_FLOW_STOP;
+    if (d->seeking)
+    {
+      // Drop the rest of the buffer so that input() is called to seek.
+      d->stream->next_frame = d->stream->bufend;
+      return MAD_FLOW_IGNORE;
+    }
+    d->frame_sample = d->next_sample;
+    d->next_sample += 32 * MAD_NSBSAMPLES(header);
+    d->position = d->frame_sample;
     return MAD_FLOW_CONTINUE;
   }
   
@@ -157,7 +244,36 @@ namespace light::decoder
       data.input_stream = in;
       data.encode_stream = encode;
       data.info = info;
-      data.pause = false;
+      data.stream = nullptr;
+      data.seeking = false;
+      data.next_sample = 0;
+      data.frame_sample = 0;
+      data.discard_until = 0;
+      data.position = 0;
+      data.probe = mpeg::probe(*in);
+      data.trim_begin = 0;
+      data.trim_end = UINT64_MAX;
+      if (data.gapless && data.probe.found && data.probe.vbr.lame)
+      {
+        auto &vbr = data.probe.vbr;
+        uint64_t samples = uint64_t(vbr.frames) * data.probe.header.samples;
+        if (samples > vbr.encoder_delay + vbr.encoder_padding)
+        {
+          // The frame holding the LAME header decodes to silence as well.
+          data.trim_begin = data.probe.header.samples + vbr.encoder_delay + decoder_delay;
+          data.trim_end = data.trim_begin + samples - vbr.encoder_delay - vbr.encoder_padding;
+        }
+      }
+      if (!data.seek_index.valid() && data.probe.found)
+      {
+        auto idx = index::SeekIndex::from_vbr_header(data.probe.vbr, data.probe.header, data.probe.offset);
+        if (!idx.empty())
+        {
+          std::promise<index::SeekIndex> promise;
+          promise.set_value(std::move(idx));
+          data.seek_index = promise.get_future().share();
+        }
+      }
       struct mad_decoder decoder;
       mad_decoder_init(&decoder, &data, input, header, 0, output, error, 0);
       mad_decoder_options(&decoder, 0);
@@ -172,24 +288,358 @@ namespace light::decoder
   
     void pause()
     {
-      if (data.pause)return;
+      std::lock_guard<std::mutex> lock(data.pause_mutex);
       data.pause = true;
     }
   
-    void skip()
+    // Drop the encoder delay and padding recorded in LAME headers, so that
+    // consecutive tracks join without silence.
+    void set_gapless(bool gapless)
+    {
+      data.gapless = gapless;
+    }
+  
+    // The index is used by seek() once it becomes ready.
+    void set_index(std::shared_future<index::SeekIndex> index_)
+    {
+      data.seek_index = std::move(index_);
+    }
+  
+    // Moves the playing position by `ms` milliseconds and returns how far it
+    // really moved.
+    long seek(long ms)
+    {
+      auto rate = data.decoder_info.samplerate;
+      if (rate == 0 || data.info != nullptr) return 0;
+      int64_t cur = data.position;
+      int64_t target = std::max<int64_t>(0, cur + int64_t(ms) * rate / 1000);
+      SeekRequest req{};
+      long moved = ms;
+      bool indexed = false;
+      if (data.seek_index.valid()
+          && data.seek_index.wait_for(std::chrono::seconds(0)) == std::future_status::ready
+          && !data.seek_index.get().empty())
+      {
+        auto &idx = data.seek_index.get();
+        auto i = idx.find(target);
+        if (idx.exact())
+        {
+          // Start a few frames early to refill the bit reservoir.
+          auto start = i;
+          while (start > 0 && (i - start < 2 || idx[i].offset - idx[start].offset < 4096))
+          {
+            --start;
+          }
+          req.offset = idx[start].offset;
+          req.sample = idx[start].sample;
+          req.target = idx[i].sample;
+          indexed = true;
+        }
+        else if (i + 1 < idx.size() && idx[i + 1].sample > idx[i].sample && idx[i + 1].offset > idx[i].offset)
+        {
+          // A table of contents has a point every few percent only, so the
+          // offset is interpolated between the two around the target. A
+          // couple of frames before it, but never before the first of them,
+          // refill the bit reservoir.
+          auto &a = idx[i];
+          auto &b = idx[i + 1];
+          uint64_t start = target - std::min<uint64_t>(target - a.sample, 2 * data.probe.header.samples);
+          req.offset = a.offset + (start - a.sample) * (b.offset - a.offset) / (b.sample - a.sample);
+          req.sample = start;
+          req.target = target;
+          indexed = true;
+        }
+        // A point behind the position does not move it the way asked.
+        indexed = indexed && (ms >= 0 ? int64_t(req.target) > cur : int64_t(req.target) < cur);
+      }
+      if (indexed)
+      {
+        moved = (int64_t(req.target) - cur) * 1000 / rate;
+      }
+      else
+      {
+        req = SeekRequest{};
+        req.relative = true;
+        req.delta = (ms >= 0 ? 1 : -1) * long(time_to_size(std::abs(ms), data.decoder_info.bitrate));
+        req.sample = target;
+        moved = (target - cur) * 1000 / rate;
+      }
+      std::lock_guard<std::mutex> lock(data.seek_mutex);
+      data.seek_request = req;
+      data.seeking = true;
+      return moved;
+    }
+  
+    long skip()
     {
-      data.input_stream->seek_cur_offset(time_to_size(5000, data.decoder_info.bitrate));
+      return seek(5000);
     }
   
-    void rewind()
+    long rewind()
     {
-      data.input_stream->seek_cur_offset(-1 * time_to_size(5000, data.decoder_info.bitrate));
+      return -seek(-5000);
     }
   
     void go()
     {
-      if (!data.pause)return;
-      data.pause = false;
+      {
+        std::lock_guard<std::mutex> lock(data.pause_mutex);
+        data.pause = false;
+      }
+      data.pause_cond.notify_all();
+    }
+  };
+  
+  // Byte offsets of every frame libmad would decode in a sequential run.
+  std::vector<std::size_t> scan_frames(stream::InputStream &in, struct mad_header *first = nullptr)
+  {
+    std::vector<std::size_t> frames;
+    std::vector<unsigned char> buffer(LIGHT_AUDIO_READ_BUFFER_SIZE + MAD_BUFFER_GUARD);
+    struct mad_stream stream;
+    struct mad_header header;
+    mad_stream_init(&stream);
+    mad_header_init(&header);
+    std::size_t base = 0;
+    bool end = false;
+    auto decode_headers = [&](const unsigned char *buf)
+    {
+      while (true)
+      {
+        if (mad_header_decode(&header, &stream) == -1)
+        {
+          if (MAD_RECOVERABLE(stream.error)) continue;
+          break;
+        }
+        if (frames.empty() && first != nullptr)
+        {
+          *first = header;
+        }
+        frames.emplace_back(base + (stream.this_frame - buf));
+      }
+    };
+    if (auto map = in.data(); map != nullptr)
+    {
+      base = in.read_size();
+      mad_stream_buffer(&stream, map + base, in.size() - base + MAD_BUFFER_GUARD);
+      decode_headers(map + base);
+      in.seek(in.size());
+      end = true;
+    }
+    while (!end)
+    {
+      std::size_t bytes = 0;
+      if (stream.next_frame != NULL)
+      {
+        bytes = stream.bufend - stream.next_frame;
+        base += stream.next_frame - buffer.data();
+        memmove(buffer.data(), stream.next_frame, bytes);
+      }
+      std::size_t length = in.read(buffer.data() + bytes, LIGHT_AUDIO_READ_BUFFER_SIZE - bytes);
+      if (in.eof() || length == 0)
+      {
+        memset(buffer.data() + bytes + length, 0, MAD_BUFFER_GUARD);
+        length += MAD_BUFFER_GUARD;
+        end = true;
+      }
+      mad_stream_buffer(&stream, buffer.data(), length + bytes);
+      decode_headers(buffer.data());
+    }
+    mad_stream_finish(&stream);
+    return frames;
+  }
+  
+  // Splits one input into frame-aligned segments decoded by worker threads.
+  // Every segment starts a few frames early so that the bit reservoir, the
+  // overlap and the synthesis filter are primed exactly as in a sequential
+  // decode, and the primed frames are discarded, so the output is
+  // sample-identical to Decoder::decode().
+  class ParallelDecoder
+  {
+  private:
+    std::function<std::shared_ptr<stream::InputStream>()> open;
+    unsigned int threads;
+    std::size_t segment_frames;
+    std::size_t preroll_bytes;
+  public:
+    ParallelDecoder(std::function<std::shared_ptr<stream::InputStream>()> open_, unsigned int threads_ = 0)
+        : open(std::move(open_)), threads(threads_), segment_frames(1024), preroll_bytes(4096)
+    {
+      if (threads == 0) threads = std::thread::hardware_concurrency();
+      if (threads == 0) threads = 1;
+    }
+    
+    void decode(const std::shared_ptr<encoder::EncodeStream> &encode,
+                const std::shared_ptr<std::promise<utils::MusicInfo>> &info)
+    {
+      auto in = open();
+      struct mad_header first;
+      auto frames = scan_frames(*in, &first);
+      if (frames.empty())
+      {
+        throw logger::Error(LIGHT_ERROR_LOCATION, __func__, "No MPEG audio frame found.");
+      }
+      std::size_t total = in->size();
+      
+      unsigned int spf = 32 * MAD_NSBSAMPLES(&first);
+      utils::MusicInfo music_info{
+          .time = static_cast<unsigned int>(frames.size() * spf * 1000 / first.samplerate),
+          .samplerate = first.samplerate,
+          .bitrate = first.bitrate,
+          .channels = 2,
+          .size = total
+      };
+      encode->set_info(music_info);
+      if (info != nullptr)
+      {
+        info->set_value(music_info);
+      }
+      
+      std::size_t nsegments = (frames.size() + segment_frames - 1) / segment_frames;
+      std::vector<std::optional<std::vector<short>>> results(nsegments);
+      std::mutex mtx;
+      std::condition_variable cond;
+      std::size_t next = 0;
+      std::size_t written = 0;
+      std::exception_ptr except;
+      
+      auto worker = [&]()
+      {
+        while (true)
+        {
+          std::size_t seg;
+          {
+            std::unique_lock<std::mutex> lock(mtx);
+            // Bound the memory held by decoded segments that wait for writing.
+            cond.wait(lock, [&] { return next >= nsegments || next < written + 2 * threads || except; });
+            if (next >= nsegments || except || !light_is_running) return;
+            seg = next++;
+          }
+          try
+          {
+            auto pcm = decode_segment(frames, seg, total);
+            std::lock_guard<std::mutex> lock(mtx);
+            results[seg] = std::move(pcm);
+          }
+          catch (...)
+          {
+            std::lock_guard<std::mutex> lock(mtx);
+            except = std::current_exception();
+          }
+          cond.notify_all();
+        }
+      };
+      
+      std::vector<std::thread> pool;
+      for (unsigned int i = 0; i < std::min<std::size_t>(threads, nsegments); ++i)
+      {
+        pool.emplace_back(worker);
+      }
+      for (std::size_t seg = 0; seg < nsegments && light_is_running; ++seg)
+      {
+        std::vector<short> pcm;
+        {
+          std::unique_lock<std::mutex> lock(mtx);
+          cond.wait(lock, [&] { return results[seg].has_value() || except; });
+          if (except) break;
+          pcm = std::move(*results[seg]);
+          results[seg].reset();
+          written = seg + 1;
+        }
+        cond.notify_all();
+        if (!pcm.empty())
+        {
+          encode->write(pcm.data(), pcm.size() * sizeof(short));
+        }
+      }
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        next = nsegments;
+      }
+      cond.notify_all();
+      for (auto &th: pool)
+      {
+        th.join();
+      }
+      if (except)
+      {
+        std::rethrow_exception(except);
+      }
+    }
+  
+  private:
+    std::vector<short> decode_segment(const std::vector<std::size_t> &frames, std::size_t seg, std::size_t total)
+    {
+      std::size_t begin = seg * segment_frames;
+      std::size_t end = std::min(begin + segment_frames, frames.size());
+      std::size_t first = begin;
+      while (first > 0 && (begin - first < 2 || frames[begin] - frames[first] < preroll_bytes))
+      {
+        --first;
+      }
+      std::size_t begin_offset = frames[begin];
+      std::size_t end_offset = end < frames.size() ? frames[end] : total;
+      
+      // Read a little past the segment so that libmad can validate its last frame.
+      auto in = open();
+      in->seek(frames[first]);
+      std::size_t want = end_offset - frames[first] + LIGHT_AUDIO_READ_BUFFER_SIZE / 16;
+      std::vector<unsigned char> buffer;
+      const unsigned char *data;
+      std::size_t length;
+      if (auto map = in->data(); map != nullptr)
+      {
+        data = map + frames[first];
+        length = std::min(want, in->size() - frames[first] + MAD_BUFFER_GUARD);
+      }
+      else
+      {
+        buffer.resize(want);
+        length = 0;
+        while (length < buffer.size() && !in->eof())
+        {
+          auto n = in->read(buffer.data() + length, buffer.size() - length);
+          if (n == 0) break;
+          length += n;
+        }
+        if (length < buffer.size())
+        {
+          buffer.resize(length + MAD_BUFFER_GUARD);
+          memset(buffer.data() + length, 0, MAD_BUFFER_GUARD);
+        }
+        data = buffer.data();
+        length = buffer.size();
+      }
+      
+      struct mad_stream stream;
+      struct mad_frame frame;
+      struct mad_synth synth;
+      mad_stream_init(&stream);
+      mad_frame_init(&frame);
+      mad_synth_init(&synth);
+      mad_stream_options(&stream, 0);
+      mad_stream_buffer(&stream, data, length);
+      
+      std::vector<short> output;
+      output.reserve((end - begin) * 1152 * 2);
+      while (true)
+      {
+        if (mad_frame_decode(&frame, &stream) == -1)
+        {
+          if (MAD_RECOVERABLE(stream.error)) continue;
+          break;
+        }
+        std::size_t offset = frames[first] + (stream.this_frame - data);
+        if (offset >= end_offset) break;
+        mad_synth_frame(&synth, &frame);
+        if (offset >= begin_offset)
+        {
+          append_pcm(output, &synth.pcm);
+        }
+      }
+      mad_synth_finish(&synth);
+      mad_frame_finish(&frame);
+      mad_stream_finish(&stream);
+      return output;
     }
   };
 }
@@ -35,6 +35,11 @@ namespace light::encoder
       info = info_;
     }
   
+    void flush()
+    {
+      if (out != nullptr) out->flush();
+    }
+  
     auto get_output()
     {
       return out;
@@ -105,8 +110,16 @@ namespace light::encoder
     void set_info(utils::MusicInfo info_) override
     {
       info = info_;
-      auto ptr = std::dynamic_pointer_cast<stream::FileOutputStream>(out);
-      ptr->native_handle().seekp(sizeof(WavHeader));
+      if (bitscount == 0)
+      {
+        auto ptr = std::dynamic_pointer_cast<stream::FileOutputStream>(out);
+        ptr->native_handle().seekp(sizeof(WavHeader));
+      }
+    }
+  
+    std::size_t size() const
+    {
+      return bitscount;
     }
     
     ~WavEncodeStream()
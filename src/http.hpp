@@ -24,19 +24,54 @@
 #include <utility>
 #include <fstream>
 #include <thread>
+#include <cstdlib>
+#include <cctype>
+#include <atomic>
+#include <array>
+#include <mutex>
+#include <map>
+#include <functional>
+#include <algorithm>
+#include <cerrno>
+#include <strings.h>
+#include <unistd.h>
 namespace light::http
 {
+  // Where a ranged download goes in a file.
+  struct FileRange
+  {
+    int fd;
+    std::size_t offset;
+    // Asked for a range, so anything but 206 is refused.
+    bool ranged;
+    // The server answered with something else than what was asked for.
+    bool refused;
+  };
+  
   class Response
   {
+  public:
+    // Where the next byte of a buffered download goes, and its generation.
+    std::size_t buffer_offset;
+    std::size_t buffer_generation;
+    bool buffer_ranged;
+    // The buffer was full and the transfer paused itself.
+    bool buffer_paused;
+    // What head() was told identifies this version of the resource.
+    std::string etag;
+    std::string last_modified;
   private:
     std::variant<int,
         std::shared_ptr<std::string>,
         std::shared_ptr<std::fstream>,
-        std::shared_ptr<stream::NetInputStream>> value;//int EMPTY
+        std::shared_ptr<stream::NetInputStream>,
+        FileRange> value;//int EMPTY
   public:
-    Response() : value(0) {}
+    Response() : buffer_offset(0), buffer_generation(0), buffer_ranged(false), buffer_paused(false), value(0) {}
     
-    Response(const Response &res) : value(res.value) {}
+    Response(const Response &res) : buffer_offset(res.buffer_offset), buffer_generation(res.buffer_generation),
+                                    buffer_ranged(res.buffer_ranged), buffer_paused(res.buffer_paused),
+                                    etag(res.etag), last_modified(res.last_modified), value(res.value) {}
     
     void set_str()
     {
@@ -61,12 +96,17 @@ namespace light::http
           (f);
     }
     
-    void set_buffer()
+    void set_buffer(std::shared_ptr<stream::NetInputStream> buffer, std::size_t offset, std::size_t generation)
+    {
+      value.emplace<std::shared_ptr<stream::NetInputStream>>(std::move(buffer));
+      buffer_offset = offset;
+      buffer_generation = generation;
+      buffer_ranged = offset != 0;
+    }
+    
+    void set_file_range(int fd, std::size_t offset, bool ranged)
     {
-      value.emplace
-          <std::shared_ptr<stream::NetInputStream>>
-          (std::make_shared<stream::NetInputStream>
-               ());
+      value.emplace<FileRange>(FileRange{fd, offset, ranged, false});
     }
     
     std::string str() { return *std::get<1>(value); }
@@ -80,6 +120,8 @@ namespace light::http
       return std::get<3>(value);
     }
     
+    FileRange &file_range() { return std::get<4>(value); }
+    
     bool is_buffer()
     {
       return value.index() == 3;
@@ -88,20 +130,64 @@ namespace light::http
     bool empty() { return value.index() == 0; }
   };
   
-  size_t buffer_progress_callback(void *userp, double dltotal, double dlnow, double ultotal, double ulnow)
+  // Sets the size from Content-Length or Content-Range before any data
+  // arrives, and notices a server that ignores Range.
+  std::size_t buffer_header_callback(char *data, size_t size, size_t nitems, void *userp)
+  {
+    auto p = (Response *) userp;
+    std::size_t n = size * nitems;
+    std::string line(data, n);
+    auto starts_with = [&line](const std::string &key)
+    {
+      return line.size() > key.size() && strncasecmp(line.c_str(), key.c_str(), key.size()) == 0;
+    };
+    if (starts_with("http/"))
+    {
+      auto space = line.find(' ');
+      if (p->buffer_ranged && space != std::string::npos && std::atoi(line.c_str() + space + 1) == 200)
+      {
+        p->buffer_offset = 0;
+        p->buffer_ranged = false;
+        p->buffer()->no_ranges();
+      }
+    }
+    else if (starts_with("content-range:"))
+    {
+      if (auto slash = line.find('/'); slash != std::string::npos && std::isdigit(line[slash + 1]))
+      {
+        p->buffer()->set_size(std::strtoull(line.c_str() + slash + 1, nullptr, 10));
+      }
+    }
+    else if (starts_with("content-length:") && !p->buffer_ranged)
+    {
+      p->buffer()->set_size(std::strtoull(line.c_str() + 15, nullptr, 10));
+    }
+    return n;
+  }
+  
+  std::size_t validator_header_callback(char *data, size_t size, size_t nitems, void *userp)
   {
-    if (dltotal == 0) return 0;
-    auto pd = (Response *) userp;
-    if (pd->buffer()->size() != dltotal)
+    auto p = (Response *) userp;
+    std::size_t n = size * nitems;
+    std::string line(data, n);
+    while (!line.empty() && (line.back() == '\r' || line.back() == '\n'))
     {
-      pd->buffer()->set_size(std::size_t(dltotal));
+      line.pop_back();
     }
-    if (dlnow == dltotal)
+    auto value = [&line](std::size_t from)
     {
-      pd->buffer()->set_eof();
+      auto begin = line.find_first_not_of(' ', from);
+      return begin == std::string::npos ? std::string() : line.substr(begin);
+    };
+    if (strncasecmp(line.c_str(), "etag:", 5) == 0)
+    {
+      p->etag = value(5);
+    }
+    else if (strncasecmp(line.c_str(), "last-modified:", 14) == 0)
+    {
+      p->last_modified = value(14);
     }
-    //LIGHT_NOTICE("Downloading : " + std::to_string((double(dlnow) / double(dltotal))* 100) + "%");
-    return 0;
+    return n;
   }
   
   std::size_t str_write_callback(void *data, size_t size, size_t nmemb, void *userp)
@@ -113,10 +199,17 @@ namespace light::http
   
   std::size_t buffer_write_callback(void *data, size_t size, size_t nmemb, void *userp)
   {
-    auto &buffer = *((Response *) userp)->buffer();
-    buffer.write((unsigned char *) data, size * nmemb);
-    buffer.get_flag() = true;
-    return size * nmemb;
+    auto p = (Response *) userp;
+    // Taking less than given aborts the transfer once the reader is gone or
+    // reads somewhere else.
+    auto n = p->buffer()->write((unsigned char *) data, size * nmemb, p->buffer_offset, p->buffer_generation);
+    if (n == stream::NetInputStream::full)
+    {
+      p->buffer_paused = true;
+      return CURL_WRITEFUNC_PAUSE;
+    }
+    p->buffer_offset += n;
+    return n;
   }
   
   std::size_t file_write_callback(void *data, size_t size, size_t nmemb, void *userp)
@@ -126,26 +219,212 @@ namespace light::http
     return size * nmemb;
   }
   
+  std::size_t range_header_callback(char *data, size_t size, size_t nitems, void *userp)
+  {
+    auto p = (Response *) userp;
+    std::size_t n = size * nitems;
+    std::string line(data, n);
+    if (n > 5 && strncasecmp(data, "http/", 5) == 0)
+    {
+      auto space = line.find(' ');
+      auto code = space == std::string::npos ? 0 : std::atoi(line.c_str() + space + 1);
+      p->file_range().refused = code != (p->file_range().ranged ? 206 : 200);
+    }
+    return n;
+  }
+  
+  std::size_t range_write_callback(void *data, size_t size, size_t nmemb, void *userp)
+  {
+    auto &range = ((Response *) userp)->file_range();
+    if (range.refused) return 0;
+    auto p = static_cast<const char *>(data);
+    std::size_t n = size * nmemb;
+    while (n != 0)
+    {
+      auto written = pwrite(range.fd, p, n, range.offset);
+      if (written < 0 && errno == EINTR) continue;
+      if (written <= 0) return 0;
+      range.offset += written;
+      p += written;
+      n -= written;
+    }
+    return size * nmemb;
+  }
+  
+  struct ClientStats
+  {
+    std::size_t requests;
+    // Transfers that found an idle connection to their host.
+    std::size_t reused;
+    std::size_t created;
+  };
+  
+  // Process-wide curl state behind every Http. A share keeps the DNS cache
+  // and TLS sessions across handles. Connections can not be shared between
+  // threads, so finished handles are pooled instead, and each keeps its idle
+  // connections across curl_easy_reset(). Transfers run by Downloads reuse
+  // the connections of its multi handle.
+  class Client
+  {
+  private:
+    static constexpr std::size_t pool_size = 8;
+    
+    CURLSH *share;
+    std::array<std::mutex, CURL_LOCK_DATA_LAST> locks;
+    std::mutex pool_mutex;
+    std::vector<CURL *> pool;
+    std::atomic<std::size_t> requests;
+    std::atomic<std::size_t> reused;
+    std::atomic<std::size_t> created;
+  public:
+    // Never destroyed, detached downloads may still run while exiting.
+    static Client &get()
+    {
+      static auto client = new Client;
+      return *client;
+    }
+    
+    Client(const Client &) = delete;
+    
+    CURL *acquire()
+    {
+      CURL *curl = nullptr;
+      {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        if (!pool.empty())
+        {
+          curl = pool.back();
+          pool.pop_back();
+        }
+      }
+      if (curl != nullptr)
+      {
+        curl_easy_reset(curl);
+      }
+      else if ((curl = curl_easy_init()) == nullptr)
+      {
+        throw logger::Error(LIGHT_ERROR_LOCATION, __func__, "curl_easy_init() failed");
+      }
+      curl_easy_setopt(curl, CURLOPT_SHARE, share);
+      curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+      curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, 600L);
+      return curl;
+    }
+    
+    void release(CURL *curl)
+    {
+      if (curl == nullptr) return;
+      {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        if (pool.size() < pool_size)
+        {
+          pool.emplace_back(curl);
+          return;
+        }
+      }
+      curl_easy_cleanup(curl);
+    }
+    
+    // Called after each transfer on `curl`.
+    void record(CURL *curl)
+    {
+      long connects = 0;
+      curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+      ++requests;
+      if (connects == 0)
+      {
+        ++reused;
+      }
+      else
+      {
+        created += connects;
+      }
+    }
+    
+    ClientStats stats() const
+    {
+      return {requests.load(), reused.load(), created.load()};
+    }
+  
+  private:
+    Client() : share(nullptr), requests(0), reused(0), created(0)
+    {
+      curl_global_init(CURL_GLOBAL_DEFAULT);
+      share = curl_share_init();
+      if (share == nullptr)
+      {
+        throw logger::Error(LIGHT_ERROR_LOCATION, __func__, "curl_share_init() failed");
+      }
+      curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock_callback);
+      curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock_callback);
+      curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+      curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+      curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
+    
+    static void lock_callback(CURL *, curl_lock_data data, curl_lock_access, void *userp)
+    {
+      static_cast<Client *>(userp)->locks[data].lock();
+    }
+    
+    static void unlock_callback(CURL *, curl_lock_data data, void *userp)
+    {
+      static_cast<Client *>(userp)->locks[data].unlock();
+    }
+  };
+  
   class Http
   {
   public:
+    // Gets the bytes received so far.
+    using Progress = std::function<void(std::size_t)>;
+    
     Response response;
     long int response_code;
   private:
     CURL *curl;
+    curl_slist *headers;
+    Progress progress;
   public:
-    Http() : response_code(-1), curl(curl_easy_init())
-    {
-      init();
-    }
+    Http() : response_code(-1), curl(Client::get().acquire()), headers(nullptr) {}
   
-    Http(const std::string &url_) : response_code(-1), curl(curl_easy_init())
+    Http(const std::string &url_) : response_code(-1), curl(Client::get().acquire()), headers(nullptr)
     {
-      init();
       set_url(url_);
     }
     
     Http(const Http &http) = delete;
+    
+    ~Http()
+    {
+      Client::get().release(curl);
+      curl_slist_free_all(headers);
+    }
+    
+    // At most `bytes` per second, 0 for no limit.
+    Http &set_speed_limit(std::size_t bytes)
+    {
+      curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE, static_cast<curl_off_t>(bytes));
+      return *this;
+    }
+    
+    // Also stops the transfer once light is quitting.
+    Http &set_progress(Progress func)
+    {
+      progress = std::move(func);
+      curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, progress_callback);
+      curl_easy_setopt(curl, CURLOPT_XFERINFODATA, this);
+      curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+      return *this;
+    }
+    
+    // `line` is a whole header, like "If-None-Match: \"abc\"".
+    Http &add_header(const std::string &line)
+    {
+      headers = curl_slist_append(headers, line.c_str());
+      curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+      return *this;
+    }
   
     Http &set_url(const std::string &url_)
     {
@@ -170,40 +449,355 @@ namespace light::http
       return *this;
     }
     
-    Http &set_buffer()
+    // Writes bytes [begin, end] of the resource at the same offsets in `fd`.
+    Http &set_file_range(int fd, std::size_t begin, std::size_t end)
+    {
+      response.set_file_range(fd, begin, true);
+      curl_easy_setopt(curl, CURLOPT_RANGE, (std::to_string(begin) + "-" + std::to_string(end)).c_str());
+      curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, range_header_callback);
+      curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response);
+      curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, range_write_callback);
+      curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+      return *this;
+    }
+    
+    // Writes the resource from byte `offset` on at the same offsets in `fd`.
+    Http &set_file_from(int fd, std::size_t offset)
+    {
+      response.set_file_range(fd, offset, offset != 0);
+      if (offset != 0)
+      {
+        curl_easy_setopt(curl, CURLOPT_RANGE, (std::to_string(offset) + "-").c_str());
+      }
+      curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, range_header_callback);
+      curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response);
+      curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, range_write_callback);
+      curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+      return *this;
+    }
+    
+    // Downloads into `buffer` from `offset` on with a Range request. The
+    // transfer pauses while the buffer is full, so it has to be run by
+    // Downloads.
+    Http &set_buffer(std::shared_ptr<stream::NetInputStream> buffer, std::size_t offset = 0,
+                     std::size_t generation = 0)
     {
-      response.set_buffer();
-      curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0);
-      curl_easy_setopt(curl, CURLOPT_PROGRESSDATA, &response);
-      curl_easy_setopt(curl, CURLOPT_PROGRESSFUNCTION, buffer_progress_callback);
+      response.set_buffer(std::move(buffer), offset, generation);
+      if (offset != 0)
+      {
+        curl_easy_setopt(curl, CURLOPT_RANGE, (std::to_string(offset) + "-").c_str());
+      }
+      curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, buffer_header_callback);
+      curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response);
       curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, buffer_write_callback);
       curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
       return *this;
     }
     
     Http &get()
+    {
+      prepare_get();
+      perform();
+      return *this;
+    }
+    
+    // Requests the headers only and returns the size, 0 if unknown. The
+    // validators end up in `response`.
+    std::size_t head()
+    {
+      curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+      curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, validator_header_callback);
+      curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response);
+      perform();
+      curl_off_t length = -1;
+      curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+      return length > 0 ? length : 0;
+    }
+  
+  private:
+    friend class Downloads;
+    
+    static int progress_callback(void *userp, curl_off_t, curl_off_t now, curl_off_t, curl_off_t)
+    {
+      static_cast<Http *>(userp)->progress(now);
+      return light_is_running ? 0 : 1;
+    }
+    
+    void prepare_get()
     {
       if (response.empty())
         set_str();
       curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+    }
+    
+    void perform()
+    {
       auto cret = curl_easy_perform(curl);
+      Client::get().record(curl);
+      // Also when a callback stopped the transfer, callers tell why by it.
+      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
       if (cret != CURLE_OK)
       {
         throw logger::Error(LIGHT_ERROR_LOCATION, __func__,
                             "curl_easy_perform() failed: '" + std::string(curl_easy_strerror(cret)) + "'.");
       }
-      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-      return *this;
+    }
+  };
+
+  // Runs transfers on one thread driving a curl multi handle. Transfers with
+  // a lower priority value start first and at most `limit` run at a time.
+  // Transfers that paused themselves are resumed every few milliseconds.
+  class Downloads
+  {
+  public:
+    // Called on the download thread when a transfer ends, `ok` is false if
+    // it failed or was cancelled.
+    using Callback = std::function<void(Http &, bool ok)>;
+  private:
+    struct Transfer
+    {
+      std::size_t id;
+      std::unique_ptr<Http> http;
+      Callback done;
+    };
+    
+    CURLM *multi;
+    std::mutex mtx;
+    // Ordered by priority, then by when they were added.
+    std::map<std::pair<int, std::size_t>, Transfer> pending;
+    std::vector<std::size_t> cancelled;
+    std::size_t next_id;
+    unsigned int limit;
+    // Only touched by the download thread.
+    std::map<std::size_t, Transfer> active;
+  public:
+    // Never destroyed, like Client.
+    static Downloads &get()
+    {
+      static auto downloads = new Downloads;
+      return *downloads;
+    }
+    
+    Downloads(const Downloads &) = delete;
+    
+    // Returns an id for cancel(), never 0.
+    std::size_t add(std::unique_ptr<Http> http, int priority, Callback done)
+    {
+      std::size_t id;
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        id = next_id++;
+        pending.emplace(std::make_pair(priority, id), Transfer{id, std::move(http), std::move(done)});
+      }
+      curl_multi_wakeup(multi);
+      return id;
+    }
+    
+    // The callback of the transfer still runs, on the download thread. Ids
+    // of finished transfers are ignored.
+    void cancel(std::size_t id)
+    {
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        cancelled.emplace_back(id);
+      }
+      curl_multi_wakeup(multi);
+    }
+    
+    void set_limit(unsigned int n)
+    {
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        limit = n == 0 ? 1 : n;
+      }
+      curl_multi_wakeup(multi);
     }
   
   private:
-    void init()
+    Downloads() : multi(nullptr), next_id(1), limit(4)
     {
-      if (!curl)
+      Client::get();
+      multi = curl_multi_init();
+      if (multi == nullptr)
       {
-        throw logger::Error(LIGHT_ERROR_LOCATION, __func__, "curl_easy_init() failed");
+        throw logger::Error(LIGHT_ERROR_LOCATION, __func__, "curl_multi_init() failed");
+      }
+      std::thread([this] { run(); }).detach();
+    }
+    
+    void run()
+    {
+      while (true)
+      {
+        std::vector<Transfer> ended;
+        {
+          std::lock_guard<std::mutex> lock(mtx);
+          for (auto id: cancelled)
+          {
+            if (auto it = active.find(id); it != active.end())
+            {
+              curl_multi_remove_handle(multi, it->second.http->curl);
+              ended.emplace_back(std::move(it->second));
+              active.erase(it);
+              continue;
+            }
+            for (auto it = pending.begin(); it != pending.end(); ++it)
+            {
+              if (it->second.id == id)
+              {
+                ended.emplace_back(std::move(it->second));
+                pending.erase(it);
+                break;
+              }
+            }
+          }
+          cancelled.clear();
+          while (active.size() < limit && !pending.empty())
+          {
+            auto transfer = std::move(pending.begin()->second);
+            pending.erase(pending.begin());
+            auto curl = transfer.http->curl;
+            transfer.http->prepare_get();
+            curl_easy_setopt(curl, CURLOPT_PRIVATE, reinterpret_cast<void *>(transfer.id));
+            curl_multi_add_handle(multi, curl);
+            active.emplace(transfer.id, std::move(transfer));
+          }
+        }
+        for (auto &transfer: ended)
+        {
+          transfer.done(*transfer.http, false);
+        }
+        ended.clear();
+        
+        for (auto &[id, transfer]: active)
+        {
+          if (transfer.http->response.buffer_paused)
+          {
+            transfer.http->response.buffer_paused = false;
+            curl_easy_pause(transfer.http->curl, CURLPAUSE_CONT);
+          }
+        }
+        int running = 0;
+        curl_multi_perform(multi, &running);
+        int left = 0;
+        while (auto msg = curl_multi_info_read(multi, &left))
+        {
+          if (msg->msg != CURLMSG_DONE) continue;
+          void *priv = nullptr;
+          curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv);
+          auto it = active.find(reinterpret_cast<std::size_t>(priv));
+          if (it == active.end()) continue;
+          auto result = msg->data.result;
+          auto &http = *it->second.http;
+          curl_multi_remove_handle(multi, http.curl);
+          Client::get().record(http.curl);
+          curl_easy_getinfo(http.curl, CURLINFO_RESPONSE_CODE, &http.response_code);
+          it->second.done(http, result == CURLE_OK);
+          active.erase(it);
+        }
+        bool paused = false;
+        for (auto &[id, transfer]: active)
+        {
+          paused = paused || transfer.http->response.buffer_paused;
+        }
+        curl_multi_poll(multi, nullptr, 0, paused ? 50 : 1000, nullptr);
       }
     }
   };
+  
+  // Streams `url` through a NetInputStream whose downloads are run by
+  // Downloads, copying it into `tee` if there is one. `on_close` gets the
+  // size, 0 if unknown, when the reader lets go of the stream.
+  std::shared_ptr<stream::InputStream> open_stream(const std::string &url, std::size_t window, bool spill,
+                                                   std::shared_ptr<stream::TeeFile> tee = nullptr,
+                                                   std::function<void(std::size_t)> on_close = nullptr)
+  {
+    auto buf = std::make_shared<stream::NetInputStream>();
+    buf->set_window(window, spill);
+    buf->set_tee(std::move(tee));
+    std::weak_ptr<stream::NetInputStream> weak = buf;
+    // The running download, replaced by each new one.
+    auto current = std::make_shared<std::atomic<std::size_t>>(0);
+    buf->set_fetcher([url, weak, current](std::size_t offset, std::size_t generation)
+                     {
+                       auto net = weak.lock();
+                       if (net == nullptr) return;
+                       auto res = std::make_unique<Http>(url);
+                       res->set_buffer(net, offset, generation);
+                       // A download from elsewhere than 0 is a seek the reader waits for.
+                       auto id = Downloads::get().add(std::move(res), offset == 0 ? 1 : 0,
+                                                      [weak, generation](Http &, bool)
+                                                      {
+                                                        // Streams without Content-Length only end here.
+                                                        if (auto net = weak.lock())
+                                                        {
+                                                          net->finish(generation);
+                                                        }
+                                                      });
+                       if (auto old = current->exchange(id); old != 0)
+                       {
+                         Downloads::get().cancel(old);
+                       }
+                     });
+    buf->start();
+    // Stop the downloads when the reader lets go of the stream.
+    return std::shared_ptr<stream::InputStream>(buf.get(), [buf, current, on_close](stream::InputStream *)
+    {
+      buf->close();
+      if (auto id = current->exchange(0); id != 0)
+      {
+        Downloads::get().cancel(id);
+      }
+      if (on_close)
+      {
+        on_close(buf->size());
+      }
+    });
+  }
+  
+  // Downloads `ranges` [first, second) of `url` into `tee` in the
+  // background, splitting each into up to `parts` transfers of at least
+  // 1 MB. `done` is called once all of them ended, whether they got
+  // everything or not.
+  void fill(const std::string &url, std::shared_ptr<stream::TeeFile> tee,
+            const std::vector<std::pair<std::size_t, std::size_t>> &ranges, unsigned int parts,
+            std::function<void()> done)
+  {
+    const std::size_t min_part = 1024 * 1024;
+    // Below what open_stream() uses, so playing is not slowed down.
+    const int priority = 2;
+    std::vector<std::pair<std::size_t, std::size_t>> pieces;
+    for (auto &[begin, end]: ranges)
+    {
+      std::size_t n = std::clamp<std::size_t>((end - begin) / min_part, 1, std::max(parts, 1u));
+      for (std::size_t i = 0; i < n; ++i)
+      {
+        pieces.emplace_back(begin + (end - begin) * i / n, begin + (end - begin) * (i + 1) / n);
+      }
+    }
+    if (pieces.empty())
+    {
+      done();
+      return;
+    }
+    auto left = std::make_shared<std::atomic<std::size_t>>(pieces.size());
+    for (auto &[begin, end]: pieces)
+    {
+      auto res = std::make_unique<Http>(url);
+      res->set_file_range(tee->get_fd(), begin, end - 1);
+      Downloads::get().add(std::move(res), priority,
+                           [tee, left, done, begin = begin, end = end](Http &h, bool ok)
+                           {
+                             if (ok && h.response_code == 206 && h.response.file_range().offset == end)
+                             {
+                               tee->cover(begin, end);
+                             }
+                             if (--*left == 0)
+                             {
+                               done();
+                             }
+                           });
+    }
+  }
 }
 #endif
\ No newline at end of file
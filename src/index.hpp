@@ -0,0 +1,235 @@
+//   Copyright 2022 light - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef LIGHT_INDEX_HPP
+#define LIGHT_INDEX_HPP
+
+#include "mpeg.hpp"
+#include "stream.hpp"
+#include "logger.hpp"
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <filesystem>
+#include <cstdint>
+#include <cstdlib>
+
+namespace light::index
+{
+  uint64_t fnv1a(const std::string &str)
+  {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (auto c: str)
+    {
+      hash ^= static_cast<unsigned char>(c);
+      hash *= 0x100000001b3ULL;
+    }
+    return hash;
+  }
+
+  std::string default_path()
+  {
+    if (auto xdg = getenv("XDG_CACHE_HOME"); xdg != nullptr && *xdg != '\0')
+    {
+      return std::string(xdg) + "/light/index";
+    }
+    if (auto home = getenv("HOME"); home != nullptr && *home != '\0')
+    {
+      return std::string(home) + "/.cache/light/index";
+    }
+    return "";
+  }
+
+  // Maps the byte offset of frames to the position of their first sample.
+  // An index built by scanning every frame is exact, one built from a
+  // Xing/VBRI table of contents is only an approximation.
+  class SeekIndex
+  {
+  public:
+    struct Point
+    {
+      uint64_t offset;
+      uint64_t sample;
+    };
+  private:
+    static constexpr char magic[4] = {'L', 'I', 'D', 'X'};
+    static constexpr uint32_t version = 1;
+
+    std::vector<Point> points;
+    unsigned int samplerate;
+    bool is_exact;
+  public:
+    SeekIndex() : samplerate(0), is_exact(false) {}
+
+    static SeekIndex scan(stream::InputStream &in)
+    {
+      SeekIndex index;
+      index.is_exact = true;
+      uint64_t sample = 0;
+      mpeg::scan(in, [&index, &sample](const mpeg::Frame &frame, const unsigned char *, std::size_t,
+                                       const mpeg::FrameHeader &h)
+      {
+        if (index.samplerate == 0) index.samplerate = h.samplerate;
+        index.points.emplace_back(Point{frame.offset, sample});
+        sample += frame.samples;
+      });
+      return index;
+    }
+
+    // `first` is the offset of the frame holding the VBR header.
+    static SeekIndex from_vbr_header(const mpeg::VBRHeader &vbr, const mpeg::FrameHeader &h, std::size_t first)
+    {
+      SeekIndex index;
+      index.samplerate = h.samplerate;
+      uint64_t total = uint64_t(vbr.frames) * h.samples;
+      if (vbr.type == mpeg::VBRHeader::Type::xing && vbr.xing_toc.size() == 100 && vbr.bytes != 0)
+      {
+        for (std::size_t i = 0; i < 100; ++i)
+        {
+          index.points.emplace_back(Point{first + uint64_t(vbr.xing_toc[i]) * vbr.bytes / 256,
+                                          total * i / 100});
+        }
+      }
+      else if (vbr.type == mpeg::VBRHeader::Type::vbri)
+      {
+        uint64_t offset = first + h.size;
+        uint64_t sample = h.samples;
+        index.points.emplace_back(Point{first, 0});
+        for (auto size: vbr.vbri_toc)
+        {
+          index.points.emplace_back(Point{offset, sample});
+          offset += size;
+          sample += uint64_t(vbr.vbri_frames_per_entry) * h.samples;
+        }
+      }
+      return index;
+    }
+
+    // Loads the index of a local file from `dir`, or scans the file and
+    // saves the result there.
+    static SeekIndex load_or_build(const std::string &filename, const std::string &dir)
+    {
+      std::error_code ec;
+      auto size = std::filesystem::file_size(filename, ec);
+      if (ec) return {};
+      auto mtime = std::filesystem::last_write_time(filename, ec).time_since_epoch().count();
+      std::string path;
+      if (!dir.empty())
+      {
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.idx", static_cast<unsigned long long>(
+            fnv1a(std::filesystem::absolute(filename, ec).string())));
+        path = dir + "/" + name;
+        SeekIndex index;
+        if (index.load(path, size, mtime)) return index;
+      }
+
+      SeekIndex index;
+      try
+      {
+        stream::MappedInputStream in(filename);
+        index = scan(in);
+      }
+      catch (logger::Error &)
+      {
+        return {};
+      }
+      if (!path.empty() && !index.empty())
+      {
+        std::filesystem::create_directories(dir, ec);
+        index.save(path, size, mtime);
+      }
+      return index;
+    }
+
+    bool empty() const { return points.empty(); }
+
+    bool exact() const { return is_exact; }
+
+    unsigned int get_samplerate() const { return samplerate; }
+
+    std::size_t size() const { return points.size(); }
+
+    const Point &operator[](std::size_t i) const { return points[i]; }
+
+    // Index of the last point starting at or before `sample`.
+    std::size_t find(uint64_t sample) const
+    {
+      auto it = std::upper_bound(points.begin(), points.end(), sample,
+                                 [](uint64_t s, const Point &p) { return s < p.sample; });
+      return it == points.begin() ? 0 : it - points.begin() - 1;
+    }
+
+  private:
+    bool load(const std::string &path, uint64_t size, int64_t mtime)
+    {
+      std::ifstream fs(path, std::ios::binary);
+      if (!fs.is_open()) return false;
+      char m[4];
+      uint32_t v;
+      uint64_t s;
+      int64_t t;
+      uint64_t count;
+      fs.read(m, 4);
+      fs.read(reinterpret_cast<char *>(&v), sizeof(v));
+      fs.read(reinterpret_cast<char *>(&s), sizeof(s));
+      fs.read(reinterpret_cast<char *>(&t), sizeof(t));
+      fs.read(reinterpret_cast<char *>(&samplerate), sizeof(samplerate));
+      fs.read(reinterpret_cast<char *>(&count), sizeof(count));
+      if (!fs || memcmp(m, magic, 4) != 0 || v != version || s != size || t != mtime)
+      {
+        return false;
+      }
+      auto here = fs.tellg();
+      fs.seekg(0, std::ios::end);
+      uint64_t left = fs.tellg() - here;
+      fs.seekg(here);
+      if (count > left / sizeof(Point))
+      {
+        return false;
+      }
+      points.resize(count);
+      fs.read(reinterpret_cast<char *>(points.data()), count * sizeof(Point));
+      if (!fs)
+      {
+        points.clear();
+        return false;
+      }
+      is_exact = true;
+      return true;
+    }
+
+    void save(const std::string &path, uint64_t size, int64_t mtime) const
+    {
+      auto tmp = path + ".tmp";
+      {
+        std::ofstream fs(tmp, std::ios::binary | std::ios::trunc);
+        if (!fs.is_open()) return;
+        uint64_t count = points.size();
+        fs.write(magic, 4);
+        fs.write(reinterpret_cast<const char *>(&version), sizeof(version));
+        fs.write(reinterpret_cast<const char *>(&size), sizeof(size));
+        fs.write(reinterpret_cast<const char *>(&mtime), sizeof(mtime));
+        fs.write(reinterpret_cast<const char *>(&samplerate), sizeof(samplerate));
+        fs.write(reinterpret_cast<const char *>(&count), sizeof(count));
+        fs.write(reinterpret_cast<const char *>(points.data()), count * sizeof(Point));
+        if (!fs) return;
+      }
+      std::error_code ec;
+      std::filesystem::rename(tmp, path, ec);
+    }
+  };
+}
+#endif
@@ -45,49 +45,51 @@ static void signal_handle(int sig)
 
 int main(int argc, char *argv[])
 {
-  signal(SIGINT, signal_handle);
   Player player;
+  term::Input input({SIGINT, SIGWINCH});
+  input.on_key('q', [&player, &input]
+               {
+                 light_is_running = false;
+                 player.go();
+                 LIGHT_NOTICE("Quitting.");
+                 input.stop();
+               })
+      .on_key('k', [&player]
+              {
+                player.rewind();
+                LIGHT_NOTICE("Rewind.");
+              })
+      .on_key('l', [&player]
+              {
+                player.skip();
+                LIGHT_NOTICE("Skip.");
+              })
+      .on_key(' ', [&player]
+              {
+                if (player.is_paused())
+                {
+                  player.go();
+                  LIGHT_NOTICE("Continue.");
+                }
+                else
+                {
+                  player.pause();
+                  LIGHT_NOTICE("Paused.");
+                }
+              })
+      .on_key('i', [&player]
+              {
+                LIGHT_NOTICE(player.stats());
+              })
+      .on_signal(SIGINT, [] { signal_handle(SIGINT); })
+      .on_signal(SIGWINCH, [&player] { player.redraw(); })
+      .start_signals();
   Option option(argc, argv);
   option.add(argv[0],
-             [&player](Option::CallbackArgType args)
+             [&player, &input](Option::CallbackArgType args)
              {
-               std::thread([&player]
-                           {
-                             while (true)
-                             {
-                               if (light::term::kbhit())
-                               {
-                                 switch (light::term::getch())
-                                 {
-                                   case 'q':
-                                     light_is_running = false;
-                                     player.go();
-                                     LIGHT_NOTICE("Quitting.");
-                                     return;
-                                   case 'k':
-                                     player.rewind();
-                                     LIGHT_NOTICE("Rewind.");
-                                     break;
-                                   case 'l':
-                                     player.skip();
-                                     LIGHT_NOTICE("Skip.");
-                                     break;
-                                   case ' ':
-                                     if (player.is_paused())
-                                     {
-                                       player.go();
-                                       LIGHT_NOTICE("Continue.");
-                                     }
-                                     else
-                                     {
-                                       player.pause();
-                                       LIGHT_NOTICE("Paused.");
-                                     }
-                                     break;
-                                 }
-                               }
-                             }
-                           }).detach();
+               // Only playing takes keys, the other modes leave the terminal alone.
+               input.start();
                for (auto &r: args)
                {
                  if (is_http(r))
@@ -106,6 +108,92 @@ int main(int argc, char *argv[])
                }
                player.set_audio_server(args[0]);
              }, 10);
+  option.add("buffer",
+             [&player](Option::CallbackArgType args)
+             {
+               if (args.size() != 1)
+               {
+                 std::cout << "--buffer need exactly one argument.\n";
+               }
+               player.set_buffer_time(std::stoi(args[0]));
+             }, 10);
+  option.add("read-ahead",
+             [&player](Option::CallbackArgType args)
+             {
+               if (args.size() != 1)
+               {
+                 std::cout << "--read-ahead need exactly one argument.\n";
+               }
+               player.set_read_ahead(std::stoi(args[0]));
+             }, 10);
+  option.add("window",
+             [&player](Option::CallbackArgType args)
+             {
+               if (args.size() == 1)
+               {
+                 player.set_stream_window(std::stoul(args[0]));
+               }
+               else if (args.size() == 2 && (args[1] == "spill" || args[1] == "drop"))
+               {
+                 player.set_stream_window(std::stoul(args[0]), args[1] == "spill");
+               }
+               else
+               {
+                 std::cout << "--window need a size and optionally 'spill' or 'drop'.\n";
+               }
+             }, 10);
+  option.add("prefetch",
+             [&player](Option::CallbackArgType args)
+             {
+               if (args.size() == 1)
+               {
+                 player.set_prefetch(std::stoi(args[0]));
+               }
+               else if (args.size() == 2)
+               {
+                 player.set_prefetch(std::stoi(args[0]), std::stoul(args[1]));
+               }
+               else
+               {
+                 std::cout << "--prefetch need one or two arguments.\n";
+               }
+             }, 10);
+  option.add("downloads",
+             [&player](Option::CallbackArgType args)
+             {
+               if (args.size() == 1)
+               {
+                 player.set_download_limit(std::stoi(args[0]));
+               }
+               else
+               {
+                 std::cout << "--downloads need one argument.\n";
+               }
+             }, 10);
+  option.add("connections",
+             [&player](Option::CallbackArgType args)
+             {
+               if (args.size() == 1)
+               {
+                 player.set_connections(std::stoi(args[0]));
+               }
+               else
+               {
+                 std::cout << "--connections need one argument.\n";
+               }
+             }, 10);
+  option.add("cache-size",
+             [&player](Option::CallbackArgType args)
+             {
+               if (args.size() == 1)
+               {
+                 player.set_cache_size(std::stoul(args[0]));
+               }
+               else
+               {
+                 std::cout << "--cache-size need one argument.\n";
+               }
+             }, 10);
   option.add("c", "cache",
              [&player](Option::CallbackArgType args)
              {
@@ -146,6 +234,58 @@ int main(int argc, char *argv[])
                }
                player.output_to_file(args[0]);
              });
+  option.add("b", "batch",
+             [&player](Option::CallbackArgType args)
+             {
+               if (args.size() != 1)
+               {
+                 std::cout << "--batch need exactly one argument.\n";
+               }
+               player.output_to_batch(args[0]);
+             }, 6);
+  option.add("sync",
+             [&player](Option::CallbackArgType args)
+             {
+               if (args.size() == 0)
+               {
+                 player.output_to_sync();
+               }
+               else if (args.size() == 1)
+               {
+                 player.output_to_sync(std::stoi(args[0]));
+               }
+               else if (args.size() == 2)
+               {
+                 player.output_to_sync(std::stoi(args[0]), std::stoul(args[1]));
+               }
+               else
+               {
+                 std::cout << "--sync need at most two arguments.\n";
+               }
+             }, 6);
+  option.add("j", "jobs",
+             [&player](Option::CallbackArgType args)
+             {
+               if (args.size() != 1 || args[0].empty() || args[0].size() > 4
+                   || args[0].find_first_not_of("0123456789") != std::string::npos)
+               {
+                 std::cout << "--jobs need exactly one number of threads.\n";
+                 return;
+               }
+               player.set_jobs(std::stoi(args[0]));
+             }, 6);
+  option.add("p", "parallel",
+             [&player](Option::CallbackArgType args)
+             {
+               if (args.size() == 0)
+               {
+                 player.set_parallel(0);
+               }
+               else
+               {
+                 player.set_parallel(std::stoi(args[0]));
+               }
+             }, 6);
   option.add("o", "output",
              [&player](Option::CallbackArgType args)
              {
@@ -175,18 +315,43 @@ int main(int argc, char *argv[])
                          "Usage: light[options...] <arguments>\n"
                          "-s, --server        <PulseAudio server> Set PulseAudio server.\n"
                          "                    (default: PULSE_SERVER)\n"
+                         "--buffer            <milliseconds>      Audio queued before PulseAudio.\n"
+                         "                    (default: 500)\n"
                          "-i, --input         <music urls/paths>  Push local songs into list.\n"
                          "-c, --cache         <cache path>        Cache the music before\n"
                          "                    (default:cache/)    playing online music.\n"
+                         "--cache-size        <MB>                Remove the least recently played\n"
+                         "                    (default: 1024)     cached songs above MB, 0 keeps all.\n"
+                         "--read-ahead        <blocks>            Read local songs ahead with\n"
+                         "                    (default: 0)        io_uring instead of mmap.\n"
+                         "--window            <MB> [spill/drop]   Keep only MB of online songs in\n"
+                         "                    (default: 0, spill) memory, spill the rest to disk.\n"
+                         "--prefetch          <songs> [MB]        Fetch upcoming online songs while\n"
+                         "                    (default: 2 128)    playing, up to MB in total.\n"
+                         "--downloads         <n>                 Download at most n online songs\n"
+                         "                    (default: 4)        at a time.\n"
+                         "--connections       <n>                 Finish downloading cached songs\n"
+                         "                    (default: 4)        over n parallel connections.\n"
                          "-o, --output                            Output songs from list in order.\n"
                          "-f, --file-output   <filename>          Output will be a wav file \n"
-                         "--shuffle                               Shuffle\n"
                          "                                        instead of playing\n"
+                         "-b, --batch         <dir/pattern>       Convert every song to a wav file\n"
+                         "                                        in parallel. ('%n' -> name,\n"
+                         "                                        '%i' -> index)\n"
+                         "--sync              [n] [KB/s]          Download the online songs into\n"
+                         "                    (default: 4 0)      the cache with n transfers at\n"
+                         "                                        a time instead of playing.\n"
+                         "-j, --jobs          <threads>           Threads used by --batch.\n"
+                         "                    (default: cores)\n"
+                         "-p, --parallel      <threads>           Decode one file with several\n"
+                         "                    (default: cores)    threads for --file-output.\n"
+                         "--shuffle                               Shuffle\n"
                          "--no-bar                                With no bar.\n"
                          "--example                               See some examples.\n"
                          "-h, --help                              Get this help.\n"
                          "\n"
                          "While light is playing songs, you can use space key to pause or continue.\n"
+                         "Use 'l' to skip, 'k' to rewind and 'i' to show buffer and read-ahead statistics.\n"
                          "Use 'q' or Ctrl-C to quit.\n"
                          << std::endl;
              });
@@ -195,6 +360,8 @@ int main(int argc, char *argv[])
              {
                std::cout <<
                          "light -i a.mp3 -f a.wav -o            a.mp3 -> a.wav\n"
+                         "light -i *.mp3 -b out/ -o             *.mp3 -> out/*.wav\n"
+                         "light -i mix.mp3 -f mix.wav -p -o     mix.mp3 -> mix.wav with every core\n"
                          "light a.mp3 -s xxx.xxx.xxx\n"
                          "or light -io a.mp3 -s xxx.xxx.xxx     Play a.mp3 in server xxx.xxx.xxx\n"
                          << std::endl;
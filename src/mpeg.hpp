@@ -0,0 +1,365 @@
+//   Copyright 2022 light - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef LIGHT_MPEG_HPP
+#define LIGHT_MPEG_HPP
+
+#include "stream.hpp"
+#include "utils.hpp"
+
+#include <array>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+namespace light::mpeg
+{
+  struct FrameHeader
+  {
+    unsigned int layer;
+    bool lsf;
+    bool mono;
+    unsigned int bitrate;
+    unsigned int samplerate;
+    unsigned int samples;
+    std::size_t size;
+  };
+
+  // Parses a 4-byte MPEG audio frame header. Free-format frames are rejected
+  // because their size can not be known from the header alone.
+  bool parse_header(const unsigned char *p, FrameHeader &h)
+  {
+    static const unsigned int bitrates[2][3][15] = {
+        {
+            {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+            {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+            {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320}
+        },
+        {
+            {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+            {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+            {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160}
+        }
+    };
+    static const unsigned int samplerates[3] = {44100, 48000, 32000};
+
+    if (p[0] != 0xff || (p[1] & 0xe0) != 0xe0) return false;
+    unsigned int version = (p[1] >> 3) & 3;
+    unsigned int layer = (p[1] >> 1) & 3;
+    unsigned int bitrate_index = p[2] >> 4;
+    unsigned int samplerate_index = (p[2] >> 2) & 3;
+    if (version == 1 || layer == 0 || bitrate_index == 0 || bitrate_index == 15 || samplerate_index == 3)
+    {
+      return false;
+    }
+    h.layer = 4 - layer;
+    h.lsf = version != 3;
+    h.mono = (p[3] >> 6) == 3;
+    h.bitrate = bitrates[h.lsf][h.layer - 1][bitrate_index] * 1000;
+    h.samplerate = samplerates[samplerate_index] >> (version == 3 ? 0 : (version == 2 ? 1 : 2));
+    unsigned int padding = (p[2] >> 1) & 1;
+    if (h.layer == 1)
+    {
+      h.samples = 384;
+      h.size = (12 * h.bitrate / h.samplerate + padding) * 4;
+    }
+    else
+    {
+      h.samples = (h.layer == 3 && h.lsf) ? 576 : 1152;
+      h.size = h.samples / 8 * h.bitrate / h.samplerate + padding;
+    }
+    return true;
+  }
+
+  // Size of an ID3v2 tag starting at p, or 0 if there is none.
+  std::size_t id3v2_size(const unsigned char *p, std::size_t n)
+  {
+    if (n < 10 || memcmp(p, "ID3", 3) != 0) return 0;
+    std::size_t size = ((p[6] & 0x7f) << 21) | ((p[7] & 0x7f) << 14) | ((p[8] & 0x7f) << 7) | (p[9] & 0x7f);
+    return size + 10 + ((p[5] & 0x10) ? 10 : 0);
+  }
+
+  uint32_t read_be32(const unsigned char *p)
+  {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+  }
+
+  uint16_t read_be16(const unsigned char *p)
+  {
+    return (uint16_t(p[0]) << 8) | uint16_t(p[1]);
+  }
+
+  // Xing/Info or VBRI header found in the first frame, with the LAME extension.
+  struct VBRHeader
+  {
+    enum class Type { none, xing, vbri } type = Type::none;
+    uint32_t frames = 0;
+    uint32_t bytes = 0;
+    // Xing: 100 entries, byte position at i% as a fraction of 256.
+    std::vector<unsigned char> xing_toc;
+    // VBRI: size in bytes of every group of `vbri_frames_per_entry` frames.
+    std::vector<uint32_t> vbri_toc;
+    uint32_t vbri_frames_per_entry = 0;
+    bool lame = false;
+    unsigned int encoder_delay = 0;
+    unsigned int encoder_padding = 0;
+  };
+
+  // p points at a frame header with `n` bytes of the frame available.
+  VBRHeader parse_vbr_header(const unsigned char *p, std::size_t n, const FrameHeader &h)
+  {
+    VBRHeader ret;
+    if (h.layer != 3) return ret;
+    std::size_t xing = 4 + (h.lsf ? (h.mono ? 9 : 17) : (h.mono ? 17 : 32));
+    if (n >= xing + 8 && (memcmp(p + xing, "Xing", 4) == 0 || memcmp(p + xing, "Info", 4) == 0))
+    {
+      ret.type = VBRHeader::Type::xing;
+      uint32_t flags = read_be32(p + xing + 4);
+      std::size_t pos = xing + 8;
+      if ((flags & 1) && n >= pos + 4)
+      {
+        ret.frames = read_be32(p + pos);
+        pos += 4;
+      }
+      if ((flags & 2) && n >= pos + 4)
+      {
+        ret.bytes = read_be32(p + pos);
+        pos += 4;
+      }
+      if ((flags & 4) && n >= pos + 100)
+      {
+        ret.xing_toc.assign(p + pos, p + pos + 100);
+        pos += 100;
+      }
+      if (flags & 8) pos += 4;
+      if (n >= pos + 24 && (memcmp(p + pos, "LAME", 4) == 0
+                            || memcmp(p + pos, "Lavf", 4) == 0 || memcmp(p + pos, "Lavc", 4) == 0))
+      {
+        ret.lame = true;
+        ret.encoder_delay = (p[pos + 21] << 4) | (p[pos + 22] >> 4);
+        ret.encoder_padding = ((p[pos + 22] & 0x0f) << 8) | p[pos + 23];
+      }
+      return ret;
+    }
+    std::size_t vbri = 4 + 32;
+    if (n >= vbri + 26 && memcmp(p + vbri, "VBRI", 4) == 0)
+    {
+      ret.type = VBRHeader::Type::vbri;
+      ret.bytes = read_be32(p + vbri + 10);
+      ret.frames = read_be32(p + vbri + 14);
+      uint16_t entries = read_be16(p + vbri + 18);
+      uint16_t scale = read_be16(p + vbri + 20);
+      uint16_t entry_size = read_be16(p + vbri + 22);
+      ret.vbri_frames_per_entry = read_be16(p + vbri + 24);
+      std::size_t pos = vbri + 26;
+      if (entry_size >= 1 && entry_size <= 4 && n >= pos + entries * entry_size)
+      {
+        for (uint16_t i = 0; i < entries; ++i, pos += entry_size)
+        {
+          uint32_t v = 0;
+          for (uint16_t j = 0; j < entry_size; ++j)
+          {
+            v = (v << 8) | p[pos + j];
+          }
+          ret.vbri_toc.emplace_back(v * scale);
+        }
+      }
+    }
+    return ret;
+  }
+
+  struct Frame
+  {
+    std::size_t offset;
+    unsigned int samples;
+  };
+
+  // Walks the stream frame by frame using only the frame headers, from the
+  // current position to the end. After losing sync a header is only trusted
+  // if it is followed by another valid one.
+  template<typename Callback>
+  void scan(stream::InputStream &in, Callback &&callback)
+  {
+    std::vector<unsigned char> buffer;
+    const unsigned char *data = in.data();
+    std::size_t base = in.read_size();
+    std::size_t begin = 0;
+    std::size_t end = 0;
+    // A mapped stream is walked in place as a single buffer.
+    if (data != nullptr)
+    {
+      data += base;
+      end = in.size() - base;
+      in.seek(in.size());
+    }
+    else
+    {
+      buffer.resize(LIGHT_AUDIO_READ_BUFFER_SIZE);
+      data = buffer.data();
+    }
+    auto refill = [&]() -> bool
+    {
+      if (buffer.empty()) return false;
+      std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+      base += begin;
+      end -= begin;
+      begin = 0;
+      auto n = in.read(buffer.data() + end, buffer.size() - end);
+      end += n;
+      return n != 0;
+    };
+    refill();
+    std::size_t skip = id3v2_size(data, end);
+    bool synced = false;
+    while (true)
+    {
+      if (skip > 0)
+      {
+        std::size_t n = std::min(skip, end - begin);
+        begin += n;
+        skip -= n;
+        if (skip > 0)
+        {
+          if (!refill()) break;
+          continue;
+        }
+      }
+      if (end - begin < 4)
+      {
+        if (!refill()) break;
+        continue;
+      }
+      FrameHeader h;
+      if (!parse_header(data + begin, h))
+      {
+        synced = false;
+        ++begin;
+        continue;
+      }
+      if (end - begin < h.size + 4 && refill())
+      {
+        continue;
+      }
+      if (!synced && end - begin >= h.size + 4)
+      {
+        FrameHeader next;
+        if (!parse_header(data + begin + h.size, next)
+            || next.layer != h.layer || next.samplerate != h.samplerate)
+        {
+          ++begin;
+          continue;
+        }
+      }
+      synced = true;
+      callback(Frame{base + begin, h.samples}, data + begin, end - begin, h);
+      skip = h.size;
+    }
+  }
+
+  struct Probe
+  {
+    bool found = false;
+    FrameHeader header;
+    // Offset of the first frame in the stream.
+    std::size_t offset = 0;
+    VBRHeader vbr;
+  };
+
+  std::size_t read_full(stream::InputStream &in, unsigned char *dest, std::size_t n)
+  {
+    std::size_t length = 0;
+    while (length < n && !in.eof())
+    {
+      auto r = in.read(dest + length, n - length);
+      if (r == 0) break;
+      length += r;
+    }
+    return length;
+  }
+
+  // Finds the first frame after the current position and reads its VBR
+  // header, then restores the position.
+  Probe probe(stream::InputStream &in)
+  {
+    Probe ret;
+    std::size_t start = in.read_size();
+    std::size_t base = start;
+    std::vector<unsigned char> buffer(16384);
+    auto n = read_full(in, buffer.data(), buffer.size());
+    if (auto tag = id3v2_size(buffer.data(), n); tag != 0)
+    {
+      base += tag;
+      in.seek(base);
+      n = read_full(in, buffer.data(), buffer.size());
+    }
+    for (std::size_t i = 0; i + 4 <= n; ++i)
+    {
+      FrameHeader h;
+      if (!parse_header(buffer.data() + i, h)) continue;
+      if (i + h.size + 4 <= n)
+      {
+        FrameHeader next;
+        if (!parse_header(buffer.data() + i + h.size, next)
+            || next.layer != h.layer || next.samplerate != h.samplerate)
+        {
+          continue;
+        }
+      }
+      ret.found = true;
+      ret.header = h;
+      ret.offset = base + i;
+      ret.vbr = parse_vbr_header(buffer.data() + i, n - i, h);
+      break;
+    }
+    in.seek(start);
+    return ret;
+  }
+
+  // `size` is the size of the whole stream, 0 if unknown.
+  utils::MusicInfo to_info(const Probe &p, std::size_t size)
+  {
+    utils::MusicInfo info{
+        .time = 0,
+        .samplerate = p.header.samplerate,
+        .bitrate = p.header.bitrate,
+        .channels = 2,
+        .size = size,
+        .frames = 0,
+        .encoder_delay = 0,
+        .encoder_padding = 0
+    };
+    if (p.vbr.frames != 0)
+    {
+      info.frames = p.vbr.frames;
+      uint64_t samples = uint64_t(p.vbr.frames) * p.header.samples;
+      if (p.vbr.lame && samples > p.vbr.encoder_delay + p.vbr.encoder_padding)
+      {
+        info.encoder_delay = p.vbr.encoder_delay;
+        info.encoder_padding = p.vbr.encoder_padding;
+        samples -= p.vbr.encoder_delay + p.vbr.encoder_padding;
+      }
+      info.time = samples * 1000 / p.header.samplerate;
+      uint64_t bytes = p.vbr.bytes != 0 ? p.vbr.bytes : (size > p.offset ? size - p.offset : 0);
+      if (bytes != 0 && samples != 0)
+      {
+        info.bitrate = bytes * 8 * p.header.samplerate / samples;
+      }
+    }
+    else if (size > p.offset && p.header.bitrate != 0)
+    {
+      info.time = uint64_t(size - p.offset) * 8 * 1000 / p.header.bitrate;
+    }
+    return info;
+  }
+}
+#endif
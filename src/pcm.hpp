@@ -0,0 +1,230 @@
+//   Copyright 2022 light - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef LIGHT_PCM_HPP
+#define LIGHT_PCM_HPP
+
+#include <mad.h>
+
+#include <cstddef>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace light::pcm
+{
+  // Rounds a libmad fixed-point sample to 16 bits and clips it.
+  short scale(mad_fixed_t sample)
+  {
+    sample += (1L << (MAD_F_FRACBITS - 16));
+    if (sample >= MAD_F_ONE)
+    {
+      sample = MAD_F_ONE - 1;
+    }
+    else if (sample < -MAD_F_ONE)
+    {
+      sample = -MAD_F_ONE;
+    }
+    return sample >> (MAD_F_FRACBITS + 1 - 16);
+  }
+
+  // Every kernel writes nsamples * nchannels interleaved samples to out and
+  // gives exactly the same result as scale().
+  using Kernel = void (*)(const mad_fixed_t *const *channels, unsigned int nchannels,
+                          std::size_t nsamples, short *out);
+
+  void convert_scalar(const mad_fixed_t *const *channels, unsigned int nchannels,
+                      std::size_t nsamples, short *out)
+  {
+    if (nchannels == 1)
+    {
+      for (std::size_t i = 0; i < nsamples; ++i)
+      {
+        out[i] = scale(channels[0][i]);
+      }
+    }
+    else
+    {
+      for (std::size_t i = 0; i < nsamples; ++i)
+      {
+        out[2 * i] = scale(channels[0][i]);
+        out[2 * i + 1] = scale(channels[1][i]);
+      }
+    }
+  }
+
+#if defined(__SSE2__)
+  __m128i scale_sse2(__m128i x)
+  {
+    const __m128i hi = _mm_set1_epi32(MAD_F_ONE - 1);
+    const __m128i lo = _mm_set1_epi32(-MAD_F_ONE);
+    x = _mm_add_epi32(x, _mm_set1_epi32(1L << (MAD_F_FRACBITS - 16)));
+    __m128i mask = _mm_cmpgt_epi32(x, hi);
+    x = _mm_or_si128(_mm_and_si128(mask, hi), _mm_andnot_si128(mask, x));
+    mask = _mm_cmplt_epi32(x, lo);
+    x = _mm_or_si128(_mm_and_si128(mask, lo), _mm_andnot_si128(mask, x));
+    return _mm_srai_epi32(x, MAD_F_FRACBITS + 1 - 16);
+  }
+
+  __m128i load_sse2(const mad_fixed_t *p)
+  {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+  }
+
+  void convert_sse2(const mad_fixed_t *const *channels, unsigned int nchannels,
+                    std::size_t nsamples, short *out)
+  {
+    std::size_t i = 0;
+    if (nchannels == 1)
+    {
+      for (; i + 8 <= nsamples; i += 8)
+      {
+        __m128i m = _mm_packs_epi32(scale_sse2(load_sse2(channels[0] + i)),
+                                    scale_sse2(load_sse2(channels[0] + i + 4)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), m);
+      }
+    }
+    else
+    {
+      for (; i + 8 <= nsamples; i += 8)
+      {
+        __m128i l = _mm_packs_epi32(scale_sse2(load_sse2(channels[0] + i)),
+                                    scale_sse2(load_sse2(channels[0] + i + 4)));
+        __m128i r = _mm_packs_epi32(scale_sse2(load_sse2(channels[1] + i)),
+                                    scale_sse2(load_sse2(channels[1] + i + 4)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2 * i), _mm_unpacklo_epi16(l, r));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2 * i + 8), _mm_unpackhi_epi16(l, r));
+      }
+    }
+    const mad_fixed_t *rest[2] = {channels[0] + i, nchannels == 2 ? channels[1] + i : nullptr};
+    convert_scalar(rest, nchannels, nsamples - i, out + i * nchannels);
+  }
+
+  __attribute__((target("avx2"))) __m256i scale_avx2(__m256i x)
+  {
+    x = _mm256_add_epi32(x, _mm256_set1_epi32(1L << (MAD_F_FRACBITS - 16)));
+    x = _mm256_min_epi32(x, _mm256_set1_epi32(MAD_F_ONE - 1));
+    x = _mm256_max_epi32(x, _mm256_set1_epi32(-MAD_F_ONE));
+    return _mm256_srai_epi32(x, MAD_F_FRACBITS + 1 - 16);
+  }
+
+  __attribute__((target("avx2"))) __m256i load_avx2(const mad_fixed_t *p)
+  {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+  }
+
+  __attribute__((target("avx2")))
+  void convert_avx2(const mad_fixed_t *const *channels, unsigned int nchannels,
+                    std::size_t nsamples, short *out)
+  {
+    std::size_t i = 0;
+    if (nchannels == 1)
+    {
+      for (; i + 16 <= nsamples; i += 16)
+      {
+        // packs works per 128-bit lane, restore the sample order afterwards.
+        __m256i m = _mm256_packs_epi32(scale_avx2(load_avx2(channels[0] + i)),
+                                       scale_avx2(load_avx2(channels[0] + i + 8)));
+        m = _mm256_permute4x64_epi64(m, 0xd8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), m);
+      }
+    }
+    else
+    {
+      for (; i + 16 <= nsamples; i += 16)
+      {
+        // Lane order after packs is {0-3, 8-11 | 4-7, 12-15}, which the
+        // per-lane unpacks turn back into {0-7} and {8-15}.
+        __m256i l = _mm256_packs_epi32(scale_avx2(load_avx2(channels[0] + i)),
+                                       scale_avx2(load_avx2(channels[0] + i + 8)));
+        __m256i r = _mm256_packs_epi32(scale_avx2(load_avx2(channels[1] + i)),
+                                       scale_avx2(load_avx2(channels[1] + i + 8)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 2 * i), _mm256_unpacklo_epi16(l, r));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 2 * i + 16), _mm256_unpackhi_epi16(l, r));
+      }
+    }
+    const mad_fixed_t *rest[2] = {channels[0] + i, nchannels == 2 ? channels[1] + i : nullptr};
+    convert_sse2(rest, nchannels, nsamples - i, out + i * nchannels);
+  }
+#endif
+
+#if defined(__ARM_NEON)
+  int16x4_t scale_neon(int32x4_t x)
+  {
+    x = vaddq_s32(x, vdupq_n_s32(1L << (MAD_F_FRACBITS - 16)));
+    x = vminq_s32(x, vdupq_n_s32(MAD_F_ONE - 1));
+    x = vmaxq_s32(x, vdupq_n_s32(-MAD_F_ONE));
+    return vmovn_s32(vshrq_n_s32(x, MAD_F_FRACBITS + 1 - 16));
+  }
+
+  void convert_neon(const mad_fixed_t *const *channels, unsigned int nchannels,
+                    std::size_t nsamples, short *out)
+  {
+    std::size_t i = 0;
+    if (nchannels == 1)
+    {
+      for (; i + 8 <= nsamples; i += 8)
+      {
+        vst1q_s16(out + i, vcombine_s16(scale_neon(vld1q_s32(channels[0] + i)),
+                                        scale_neon(vld1q_s32(channels[0] + i + 4))));
+      }
+    }
+    else
+    {
+      for (; i + 8 <= nsamples; i += 8)
+      {
+        int16x8x2_t lr;
+        lr.val[0] = vcombine_s16(scale_neon(vld1q_s32(channels[0] + i)),
+                                 scale_neon(vld1q_s32(channels[0] + i + 4)));
+        lr.val[1] = vcombine_s16(scale_neon(vld1q_s32(channels[1] + i)),
+                                 scale_neon(vld1q_s32(channels[1] + i + 4)));
+        vst2q_s16(out + 2 * i, lr);
+      }
+    }
+    const mad_fixed_t *rest[2] = {channels[0] + i, nchannels == 2 ? channels[1] + i : nullptr};
+    convert_scalar(rest, nchannels, nsamples - i, out + i * nchannels);
+  }
+#endif
+
+  Kernel select_kernel()
+  {
+#if defined(__SSE2__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+      return convert_avx2;
+    }
+    return convert_sse2;
+#elif defined(__ARM_NEON)
+    return convert_neon;
+#else
+    return convert_scalar;
+#endif
+  }
+
+  const Kernel kernel = select_kernel();
+
+  // Converts one synthesized frame to interleaved S16, returns the number of
+  // samples written.
+  std::size_t convert(const struct mad_pcm *pcm, short *out)
+  {
+    const mad_fixed_t *channels[2] = {pcm->samples[0], pcm->samples[1]};
+    kernel(channels, pcm->channels, pcm->length, out);
+    return static_cast<std::size_t>(pcm->length) * pcm->channels;
+  }
+}
+#endif
@@ -15,6 +15,7 @@
 #define LIGHT_PLAYER_HPP
 
 #include "http.hpp"
+#include "cache.hpp"
 #include "tagreader.hpp"
 #include "stream.hpp"
 #include "decoder.hpp"
@@ -29,6 +30,12 @@
 #include <fstream>
 #include <random>
 #include <filesystem>
+#include <map>
+#include <set>
+#include <thread>
+#include <atomic>
+#include <future>
+#include <mutex>
 
 namespace light::player
 {
@@ -40,54 +47,226 @@ namespace light::player
     private:
       std::string music_name;
       std::function<std::shared_ptr<stream::InputStream>()> get_music_file;
+      std::string local_path;
+      std::string remote_url;
     public:
       Music(const std::string &name_,
-            const std::function<std::shared_ptr<stream::InputStream>()> &file_)
-          : music_name(name_), get_music_file(file_) {}
+            const std::function<std::shared_ptr<stream::InputStream>()> &file_,
+            const std::string &path_ = "", const std::string &url_ = "")
+          : music_name(name_), get_music_file(file_), local_path(path_), remote_url(url_) {}
   
       std::string name() const { return music_name; }
   
+      bool is_local() const { return !local_path.empty(); }
+  
+      std::string path() const { return local_path; }
+  
+      std::string url() const { return remote_url; }
+  
+      auto opener() const { return get_music_file; }
+  
       std::shared_ptr<stream::InputStream> get_file()
       {
         return get_music_file();
       }
     };
+    
+    // A track opened ahead of time, ready to be decoded.
+    struct Track
+    {
+      std::size_t pos;
+      std::shared_ptr<stream::InputStream> file;
+      std::string info;
+      std::shared_future<index::SeekIndex> seek_index;
+    };
 
   private:
     decoder::Decoder decoder;
     std::shared_ptr<encoder::EncodeStream> encode;
     std::deque<Music> music_list;
     std::size_t index;
-    std::string cache_path;
     bar::TimeBar timebar;
-    bool cache;
+    std::shared_ptr<cache::Cache> cache;
+    std::size_t cache_size;
+    bool batch;
+    std::string batch_target;
+    bool syncing;
+    unsigned int sync_transfers;
+    std::size_t sync_speed;
+    unsigned int jobs;
+    unsigned int parallel;
+    std::string index_path;
+    unsigned int prefetch_count;
+    std::size_t prefetch_budget;
+    unsigned int read_ahead;
+    std::size_t stream_window;
+    bool stream_spill;
+    unsigned int connections;
+    std::mutex prefetch_mutex;
+    std::map<std::size_t, std::shared_future<std::shared_ptr<stream::InputStream>>> prefetched;
+    // What the screen shows, which lags behind `index` while the end of the
+    // previous track is still playing.
+    std::mutex draw_mutex;
+    std::size_t playing;
+    std::string playing_info;
+    std::shared_ptr<stream::InputStream> playing_file;
   public:
-    Player() : timebar({0, 0}), index(0), cache(false),
+    Player() : timebar({0, 0}), index(0), cache_size(1024 * 1024 * 1024), batch(false), syncing(false), sync_transfers(4), sync_speed(0), jobs(0), parallel(1),
+               index_path(index::default_path()), prefetch_count(2), prefetch_budget(128 * 1024 * 1024),
+               read_ahead(0), stream_window(0), stream_spill(true), connections(4), playing(0),
                encode(std::make_shared<encoder::AudioEncodeStream>()) {}
   
     Player &set_audio_server(const std::string &server)
     {
-      auto ptr = std::make_shared<stream::AudioOutputStream>();
-      ptr->set_audio_server(server);
-      std::dynamic_pointer_cast<encoder::AudioEncodeStream>(encode)->set_out(ptr);
+      if (auto out = audio_output(); out != nullptr)
+      {
+        out->set_audio_server(server);
+      }
+      return *this;
+    }
+  
+    // Milliseconds of decoded audio queued in front of PulseAudio.
+    Player &set_buffer_time(unsigned int ms)
+    {
+      if (auto out = audio_output(); out != nullptr)
+      {
+        out->set_buffer_time(ms);
+      }
       return *this;
     }
   
+    std::string stats()
+    {
+      auto out = audio_output();
+      if (out == nullptr) return "";
+      auto s = out->stats();
+      auto ret = "Buffer: " + std::to_string(s.buffered_ms) + "/" + std::to_string(s.buffer_ms) + " ms, underruns: "
+                 + std::to_string(s.underruns) + ", overruns: " + std::to_string(s.overruns);
+      std::lock_guard<std::mutex> lock(draw_mutex);
+      if (auto in = std::dynamic_pointer_cast<stream::ReadAheadInputStream>(playing_file); in != nullptr)
+      {
+        auto r = in->stats();
+        ret += ". Read-ahead (" + r.backend + "): " + std::to_string(r.in_flight) + "/" + std::to_string(r.depth)
+               + " in flight, stalls: " + std::to_string(r.stalls) + "/" + std::to_string(r.blocks);
+      }
+      if (auto net = std::dynamic_pointer_cast<stream::NetInputStream>(playing_file); net != nullptr)
+      {
+        auto b = net->stats();
+        ret += ". Stream: " + std::to_string(static_cast<unsigned long>(b.throughput / 1024)) + " KB/s for "
+               + std::to_string(b.bitrate / 1000) + " kbps, " + std::to_string(b.buffered / 1024) + " KB buffered"
+               + (b.buffering ? " (buffering)" : "") + ", stalls: " + std::to_string(b.stalls) + ", rebuffers: "
+               + std::to_string(b.rebuffers) + ", waited: " + std::to_string(static_cast<unsigned long>(b.waited_ms))
+               + " ms";
+      }
+      if (auto h = http::Client::get().stats(); h.requests != 0)
+      {
+        ret += ". HTTP: " + std::to_string(h.requests) + " requests, connections reused: "
+               + std::to_string(h.reused) + ", new: " + std::to_string(h.created);
+      }
+      return ret;
+    }
+  
     Player &output_to_file(std::string name)
     {
       encode = std::make_shared<encoder::WavEncodeStream>(std::move(name));
       return *this;
     }
   
-    Player &enable_cache(const std::string &cachepath = "cache/")
+    // target is a directory, or a filename pattern where '%n' is replaced
+    // by the input's name and '%i' by its position in the list.
+    Player &output_to_batch(std::string target)
+    {
+      batch_target = std::move(target);
+      batch = true;
+      return *this;
+    }
+    
+    // Instead of playing, download the online songs into the cache with
+    // `transfers` at a time, sharing `kbps` KB/s. 0 for no limit.
+    Player &output_to_sync(unsigned int transfers = 4, std::size_t kbps = 0)
+    {
+      sync_transfers = transfers == 0 ? 1 : transfers;
+      sync_speed = kbps * 1024;
+      syncing = true;
+      return *this;
+    }
+  
+    Player &set_jobs(unsigned int jobs_)
+    {
+      jobs = jobs_;
+      return *this;
+    }
+  
+    // Decode each local file with several threads when writing to a file.
+    // 0 means one thread per core.
+    Player &set_parallel(unsigned int threads)
+    {
+      parallel = threads;
+      return *this;
+    }
+  
+    // Where seek indexes of local files are kept, empty to not keep them.
+    Player &set_index_path(const std::string &path)
+    {
+      index_path = path;
+      return *this;
+    }
+  
+    // Read local files through `depth` blocks of read-ahead instead of
+    // mapping them, for filesystems where a page fault is slow. 0 to map.
+    Player &set_read_ahead(unsigned int depth)
+    {
+      read_ahead = depth;
+      return *this;
+    }
+  
+    // Keep only `mb` MB of an online song around the playing position when
+    // it is not cached. What falls behind is spilled to a temporary file, or
+    // dropped if `spill` is false. 0 keeps everything in memory.
+    Player &set_stream_window(std::size_t mb, bool spill = true)
+    {
+      stream_window = mb * 1024 * 1024;
+      stream_spill = spill;
+      return *this;
+    }
+  
+    // Fetch up to `count` online songs after the playing one in the
+    // background, as long as those already fetched take less than `mb` MB.
+    Player &set_prefetch(unsigned int count, std::size_t mb = 128)
+    {
+      prefetch_count = count;
+      prefetch_budget = mb * 1024 * 1024;
+      return *this;
+    }
+  
+    // Run at most `n` downloads of online songs at a time.
+    Player &set_download_limit(unsigned int n)
     {
-      std::filesystem::path p(cachepath);
-      if (!std::filesystem::exists(p))
+      http::Downloads::get().set_limit(n);
+      return *this;
+    }
+  
+    // Download the rest of cached songs over up to `n` ranged connections.
+    Player &set_connections(unsigned int n)
+    {
+      connections = n == 0 ? 1 : n;
+      return *this;
+    }
+  
+    // Keep at most `mb` MB of cached songs, 0 for no limit.
+    Player &set_cache_size(std::size_t mb)
+    {
+      cache_size = mb * 1024 * 1024;
+      if (cache != nullptr)
       {
-        std::filesystem::create_directory(p);
+        cache->set_capacity(cache_size);
       }
-      cache_path = cachepath;
-      cache = true;
+      return *this;
+    }
+  
+    Player &enable_cache(const std::string &cachepath = "cache/")
+    {
+      cache = std::make_shared<cache::Cache>(cachepath, cache_size);
       return *this;
     };
   
@@ -100,6 +279,10 @@ namespace light::player
     {
       timebar.pause();
       decoder.pause();
+      if (auto out = audio_output(); out != nullptr)
+      {
+        out->pause();
+      }
       return *this;
     }
   
@@ -107,81 +290,49 @@ namespace light::player
     {
       timebar.go();
       decoder.go();
+      if (auto out = audio_output(); out != nullptr)
+      {
+        out->go();
+      }
       return *this;
     }
   
     Player &skip()
     {
-      decoder.skip();
-      timebar.skip();
+      timebar.skip(decoder.skip());
       return *this;
     }
   
     Player &rewind()
     {
-      decoder.rewind();
-      timebar.rewind();
+      timebar.rewind(decoder.rewind());
       return *this;
     }
   
     Player &seek()
     {
-      timebar.go();
-      decoder.go();
-      return *this;
+      return go();
     }
   
     Player &push_online(const std::string &url,
-                        const std::string &music_name = "online music",
-                        const std::string &file_name =
-                        std::to_string(std::chrono::system_clock::now()
-                                           .time_since_epoch().count()))
+                        const std::string &music_name = "online music")
     {
       std::function<std::shared_ptr<stream::InputStream>()> func;
       if (cache)
       {
-        std::string filename = cache_path + "/"
-                               + file_name;
-        func = [this, url, filename]() -> std::shared_ptr<stream::InputStream>
+        func = [this, url]() -> std::shared_ptr<stream::InputStream>
         {
-          http::Http res(url);
-          res.set_file(filename).get();
-          auto t = res.response.file();
-          if (res.response_code != 200 || !t->is_open())
-          {
-            throw logger::Error(LIGHT_ERROR_LOCATION, __func__,
-                                "Download music failed");
-          }
-          t->clear();
-          t->seekg(std::ios_base::beg);
-          return std::make_shared<stream::FileInputStream>(t);
+          return cache->open(url, connections, stream_window, stream_spill);
         };
       }
       else
       {
         func = [this, url]() -> std::shared_ptr<stream::InputStream>
         {
-          std::mutex mtx;
-          std::shared_ptr<stream::InputStream> buf;
-          std::condition_variable cond;
-          std::thread th(
-              [&]()
-              {
-                http::Http res(url);
-                res.set_buffer();
-                mtx.lock();
-                buf = res.response.buffer();
-                mtx.unlock();
-                cond.notify_all();
-                res.get();
-              });
-          th.detach();
-          std::unique_lock<std::mutex> lock(mtx);
-          cond.wait(lock, [&] { return buf != nullptr; });
-          return buf;
+          return http::open_stream(url, stream_window, stream_spill);
         };
       }
-      music_list.emplace_back(Music(music_name, func));
+      music_list.emplace_back(Music(music_name, func, "", url));
       return *this;
     }
     
@@ -194,6 +345,15 @@ namespace light::player
           throw logger::Error(LIGHT_ERROR_LOCATION, __func__,
                               "No such file '" + filename + "'.");
         }
+        try
+        {
+          if (read_ahead != 0)
+          {
+            return std::make_shared<stream::ReadAheadInputStream>(filename, read_ahead);
+          }
+          return std::make_shared<stream::MappedInputStream>(filename);
+        }
+        catch (logger::Error &) {}
         auto f = std::make_shared<std::fstream>(std::fstream(filename,
                                                              std::ios_base::in | std::ios_base::binary));
         if (!f->is_open())
@@ -202,48 +362,40 @@ namespace light::player
         }
         return std::make_shared<stream::FileInputStream>(f);
       };
-      music_list.emplace_back(Music((music_name != "" ? music_name : filename), func));
+      music_list.emplace_back(Music((music_name != "" ? music_name : filename), func, filename));
       return *this;
     }
   
     Player &output(int num = -1)
     {
       if (num == -1) num = music_list.size();
+      if (batch)
+      {
+        output_batch(num);
+        return *this;
+      }
+      if (syncing)
+      {
+        output_sync(num);
+        return *this;
+      }
+      if (encode->get_output()->get_mode() == stream::OutputMode::audio)
+      {
+        output_audio(num);
+        return *this;
+      }
       for (auto i = 0; i < num; i++)
       {
         check_list();
-        if (encode->get_output()->get_mode() == stream::OutputMode::audio)
+        if (parallel != 1 && music_list[index].is_local())
         {
-          term::clear();
-          std::size_t ypos = 0;
-          term::mv_xcenter_output(ypos++, "light - A simple music player by caozhanhao");
-          ypos++;
-          term::mvoutput({0, ypos++}, "Music List: ");
-          for (std::size_t i = index; i < music_list.size(); ++i)
-          {
-            if (ypos > term::get_height() - 5) break;
-            if (i == index)
-            {
-              term::mvoutput({0, ypos++}, std::to_string(i + 1) + "| "
-                                          + utils::colorify(music_list[i].name(), utils::Color::LIGHT_BLUE) +
-                                          " (playing)");
-            }
-            else
-            {
-              term::mvoutput({0, ypos++}, std::to_string(i + 1) + "| " + music_list[i].name());
-            }
-          }
-          auto file = music_list[index].get_file();
-          term::mvoutput({0, term::get_height() - 4}, "Playing: ");
-          auto name = music_list[index].name();
-          term::mvoutput({0, term::get_height() - 3}, tagreader::TagInfo(file).common_info());
-          term::mvoutput({0, term::get_height() - 2}, name);
-          timebar.set_pos({name.size() + 1, term::get_height() - 2});
-          play(file);
+          decoder::ParallelDecoder(music_list[index].opener(), parallel)
+              .decode(encode, std::make_shared<std::promise<utils::MusicInfo>>());
         }
         else
         {
-          decoder.decode(music_list[index].get_file(), encode, nullptr);
+          decoder.decode(music_list[index].get_file(), encode,
+                         std::make_shared<std::promise<utils::MusicInfo>>());
         }
         index++;
         if (!light_is_running) return *this;
@@ -251,6 +403,18 @@ namespace light::player
       return *this;
     }
   
+    // Draws the screen again, e.g. after the terminal was resized.
+    Player &redraw()
+    {
+      std::lock_guard<std::mutex> lock(draw_mutex);
+      if (encode->get_output()->get_mode() == stream::OutputMode::audio && !playing_info.empty())
+      {
+        draw_list();
+        draw_playing();
+      }
+      return *this;
+    }
+  
     Player &shuffle()
     {
       std::mt19937 gen(std::random_device{}());
@@ -259,14 +423,386 @@ namespace light::player
     }
 
   private:
-    void play(const std::shared_ptr<stream::InputStream> &in)
+    std::shared_ptr<stream::AudioOutputStream> audio_output()
+    {
+      return std::dynamic_pointer_cast<stream::AudioOutputStream>(encode->get_output());
+    }
+    
+    void draw_list()
+    {
+      term::clear();
+      std::size_t ypos = 0;
+      term::mv_xcenter_output(ypos++, "light - A simple music player by caozhanhao");
+      ypos++;
+      term::mvoutput({0, ypos++}, "Music List: ");
+      for (std::size_t i = playing; i < music_list.size(); ++i)
+      {
+        if (ypos > term::get_height() - 5) break;
+        if (i == playing)
+        {
+          term::mvoutput({0, ypos++}, std::to_string(i + 1) + "| "
+                                      + utils::colorify(music_list[i].name(), utils::Color::LIGHT_BLUE) +
+                                      " (playing)");
+        }
+        else
+        {
+          term::mvoutput({0, ypos++}, std::to_string(i + 1) + "| " + music_list[i].name());
+        }
+      }
+    }
+    
+    void draw_playing()
+    {
+      term::mvoutput({0, term::get_height() - 4}, "Playing: ");
+      auto name = music_list[playing].name();
+      term::mvoutput({0, term::get_height() - 3}, playing_info);
+      term::mvoutput({0, term::get_height() - 2}, name);
+      timebar.set_pos({name.size() + 1, term::get_height() - 2});
+    }
+    
+    std::string batch_name(std::size_t i) const
+    {
+      std::filesystem::path in(music_list[i].name());
+      std::string name = std::filesystem::exists(in) ? in.stem().string() : "track" + std::to_string(i + 1);
+      auto replace = [](std::string str, const std::string &from, const std::string &to)
+      {
+        for (auto pos = str.find(from); pos != std::string::npos; pos = str.find(from, pos + to.size()))
+        {
+          str.replace(pos, from.size(), to);
+        }
+        return str;
+      };
+      if (batch_target.find('%') != std::string::npos)
+      {
+        return replace(replace(batch_target, "%n", name), "%i", std::to_string(i + 1));
+      }
+      std::filesystem::path dir(batch_target);
+      if (!std::filesystem::exists(dir))
+      {
+        std::filesystem::create_directories(dir);
+      }
+      return (dir / (name + ".wav")).string();
+    }
+    
+    void output_batch(std::size_t num)
+    {
+      num = std::min(num, music_list.size() - index);
+      if (num == 0)
+      {
+        check_list();
+        return;
+      }
+      unsigned int nthreads = jobs != 0 ? jobs : std::thread::hardware_concurrency();
+      if (nthreads == 0) nthreads = 1;
+      if (nthreads > num) nthreads = num;
+      
+      std::atomic<std::size_t> next = index;
+      std::atomic<std::size_t> done = 0;
+      std::atomic<std::size_t> failed = 0;
+      std::atomic<std::size_t> in_bytes = 0;
+      std::atomic<std::size_t> out_bytes = 0;
+      std::atomic<unsigned long> audio_ms = 0;
+      const std::size_t end = index + num;
+      // Two inputs with the same name must not share an output file.
+      std::vector<std::string> names;
+      std::set<std::string> taken;
+      for (auto i = index; i < end; ++i)
+      {
+        auto name = batch_name(i);
+        std::filesystem::path path(name);
+        for (std::size_t n = 2; !taken.insert(name).second; ++n)
+        {
+          name = (path.parent_path() / (path.stem().string() + "-" + std::to_string(n)
+                                        + path.extension().string())).string();
+        }
+        names.emplace_back(name);
+      }
+      auto worker = [&]()
+      {
+        for (auto i = next++; i < end && light_is_running; i = next++)
+        {
+          try
+          {
+            decoder::Decoder d;
+            auto in = music_list[i].get_file();
+            auto out = std::make_shared<encoder::WavEncodeStream>(names[i - index]);
+            auto info = std::make_shared<std::promise<utils::MusicInfo>>();
+            auto future = info->get_future();
+            d.decode(in, out, info);
+            if (future.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+            {
+              audio_ms += future.get().time;
+            }
+            in_bytes += in->size();
+            out_bytes += out->size();
+            ++done;
+          }
+          catch (logger::Error &e)
+          {
+            ++failed;
+            LIGHT_NOTICE("Converting '" + music_list[i].name() + "' failed.");
+          }
+        }
+      };
+      
+      LIGHT_NOTICE("Converting " + std::to_string(num) + " tracks with "
+                   + std::to_string(nthreads) + " threads.");
+      auto begin = std::chrono::steady_clock::now();
+      std::vector<std::thread> pool;
+      for (unsigned int i = 0; i < nthreads; ++i)
+      {
+        pool.emplace_back(worker);
+      }
+      for (auto &th: pool)
+      {
+        th.join();
+      }
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+      index = end;
+      
+      double secs = std::max(elapsed.count(), 1e-6);
+      auto fixed = [](double v)
+      {
+        auto str = std::to_string(v);
+        return str.substr(0, str.find('.') + 3);
+      };
+      LIGHT_NOTICE("Converted " + std::to_string(done) + " tracks (" + std::to_string(failed) + " failed) in "
+                   + fixed(secs) + "s: " + fixed(done / secs) + " tracks/s, "
+                   + fixed(in_bytes / secs / 1048576) + " MB/s in, "
+                   + fixed(out_bytes / secs / 1048576) + " MB/s out, "
+                   + fixed(audio_ms / 1000.0 / secs) + "x realtime.");
+    }
+    
+    void output_sync(std::size_t num)
+    {
+      num = std::min(num, music_list.size() - index);
+      if (num == 0)
+      {
+        check_list();
+        return;
+      }
+      if (cache == nullptr) enable_cache();
+      std::vector<std::size_t> online;
+      // A URL listed twice would be downloaded into the same file twice at once.
+      std::set<std::string> urls;
+      for (auto i = index; i < index + num; ++i)
+      {
+        if (!music_list[i].is_local() && urls.insert(music_list[i].url()).second) online.emplace_back(i);
+      }
+      index += num;
+      if (online.empty()) return;
+      
+      unsigned int nthreads = std::min<std::size_t>(sync_transfers, online.size());
+      std::atomic<std::size_t> next = 0;
+      std::atomic<std::size_t> done = 0;
+      std::atomic<std::size_t> failed = 0;
+      std::atomic<std::size_t> received = 0;
+      auto worker = [&]()
+      {
+        for (auto i = next++; i < online.size() && light_is_running; i = next++)
+        {
+          auto &music = music_list[online[i]];
+          std::size_t last = 0;
+          bool ok = false;
+          try
+          {
+            ok = cache->sync(music.url(), sync_speed / nthreads, [&received, &last](std::size_t now)
+            {
+              if (now < last) last = 0;
+              received += now - last;
+              last = now;
+            });
+          }
+          catch (logger::Error &) {}
+          ok ? ++done : ++failed;
+          LIGHT_NOTICE("[" + std::to_string(done + failed) + "/" + std::to_string(online.size()) + "] "
+                       + (ok ? "Synced '" : "Syncing failed: '") + music.name() + "'.");
+        }
+      };
+      
+      auto fixed = [](double v)
+      {
+        auto str = std::to_string(v);
+        return str.substr(0, str.find('.') + 3);
+      };
+      LIGHT_NOTICE("Syncing " + std::to_string(online.size()) + " online songs with "
+                   + std::to_string(nthreads) + " transfers.");
+      auto begin = std::chrono::steady_clock::now();
+      std::vector<std::thread> pool;
+      for (unsigned int i = 0; i < nthreads; ++i)
+      {
+        pool.emplace_back(worker);
+      }
+      std::size_t reported = 0;
+      while (done + failed < online.size() && light_is_running)
+      {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        std::size_t now = received;
+        LIGHT_NOTICE("Syncing: " + std::to_string(done + failed) + "/" + std::to_string(online.size()) + " songs, "
+                     + fixed(now / 1048576.0) + " MB, " + fixed((now - reported) / 1048576.0) + " MB/s.");
+        reported = now;
+      }
+      for (auto &th: pool)
+      {
+        th.join();
+      }
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+      double secs = std::max(elapsed.count(), 1e-6);
+      LIGHT_NOTICE("Synced " + std::to_string(done) + " songs (" + std::to_string(failed) + " failed), "
+                   + fixed(received / 1048576.0) + " MB downloaded in " + fixed(secs) + "s, "
+                   + fixed(received / secs / 1048576) + " MB/s.");
+    }
+    
+    void prefetch(std::size_t from)
+    {
+      std::lock_guard<std::mutex> lock(prefetch_mutex);
+      for (auto it = prefetched.begin(); it != prefetched.end();)
+      {
+        it = it->first < from ? prefetched.erase(it) : std::next(it);
+      }
+      if (prefetch_count == 0) return;
+      // Every song fetched ahead downloads at most its share of the budget,
+      // one still being opened counts as its whole share.
+      std::size_t share = prefetch_budget / prefetch_count;
+      std::size_t used = 0;
+      for (auto &[pos, file]: prefetched)
+      {
+        if (file.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        {
+          used += share;
+          continue;
+        }
+        try
+        {
+          if (auto net = std::dynamic_pointer_cast<stream::NetInputStream>(file.get()); net != nullptr)
+          {
+            used += net->held();
+          }
+        }
+        catch (...) {}
+      }
+      for (auto pos = from; pos < from + prefetch_count && pos < music_list.size(); ++pos)
+      {
+        if (share == 0 || used + share > prefetch_budget) break;
+        if (music_list[pos].is_local() || prefetched.count(pos) != 0) continue;
+        auto promise = std::make_shared<std::promise<std::shared_ptr<stream::InputStream>>>();
+        prefetched[pos] = promise->get_future().share();
+        used += share;
+        std::thread([promise, share, open = music_list[pos].opener()]
+                    {
+                      try
+                      {
+                        auto file = open();
+                        if (auto net = std::dynamic_pointer_cast<stream::NetInputStream>(file); net != nullptr)
+                        {
+                          net->set_ahead_limit(share);
+                        }
+                        promise->set_value(file);
+                      }
+                      catch (...)
+                      {
+                        promise->set_exception(std::current_exception());
+                      }
+                    }).detach();
+      }
+    }
+    
+    // Takes the prefetched file if there is one, a failed prefetch is tried
+    // again.
+    std::shared_ptr<stream::InputStream> open(std::size_t pos)
+    {
+      std::shared_future<std::shared_ptr<stream::InputStream>> file;
+      {
+        std::lock_guard<std::mutex> lock(prefetch_mutex);
+        if (auto it = prefetched.find(pos); it != prefetched.end())
+        {
+          file = it->second;
+          prefetched.erase(it);
+        }
+      }
+      if (file.valid())
+      {
+        try
+        {
+          auto ret = file.get();
+          if (auto net = std::dynamic_pointer_cast<stream::NetInputStream>(ret); net != nullptr)
+          {
+            net->set_ahead_limit(0);
+          }
+          return ret;
+        }
+        catch (logger::Error &) {}
+      }
+      return music_list[pos].get_file();
+    }
+    
+    Track prepare(std::size_t pos)
+    {
+      Track track{pos, open(pos)};
+      track.info = tagreader::TagInfo(track.file).common_info();
+      if (music_list[pos].is_local())
+      {
+        auto promise = std::make_shared<std::promise<index::SeekIndex>>();
+        track.seek_index = promise->get_future().share();
+        std::thread([promise, path = music_list[pos].path(), dir = index_path]
+                    {
+                      index::SeekIndex index;
+                      try
+                      {
+                        index = index::SeekIndex::load_or_build(path, dir);
+                      }
+                      catch (std::exception &) {}
+                      promise->set_value(std::move(index));
+                    }).detach();
+      }
+      return track;
+    }
+    
+    // Opens the next track while the current one is decoded and starts
+    // decoding it as soon as the current one is done. The audio still queued
+    // keeps playing meanwhile, so tracks join without a gap and the screen
+    // switches when the new track is heard.
+    void output_audio(std::size_t num)
+    {
+      decoder.set_gapless(true);
+      std::future<Track> next;
+      for (std::size_t i = 0; i < num; ++i)
+      {
+        check_list();
+        auto track = next.valid() ? next.get() : prepare(index);
+        prefetch(index + 1);
+        if (i + 1 < num && index + 1 < music_list.size())
+        {
+          next = std::async(std::launch::async, [this, pos = index + 1] { return prepare(pos); });
+        }
+        play(track);
+        index++;
+        if (!light_is_running) break;
+      }
+      if (auto out = audio_output(); out != nullptr && light_is_running)
+      {
+        // Nothing is written any more, so the ring running empty now is the
+        // end and not an underrun.
+        out->drain();
+      }
+      timebar.drain();
+    }
+    
+    void play(const Track &track)
     {
       std::shared_ptr<std::promise<utils::MusicInfo>> info{std::make_shared<std::promise<utils::MusicInfo>>()};
+      decoder.set_index(track.seek_index);
       timebar.set_info(info);
-      timebar.start();
-      decoder.decode(in, encode, info);
-      timebar.drain();
-      timebar.reset();
+      timebar.start(0, [this, pos = track.pos, tag = track.info, file = track.file]
+      {
+        std::lock_guard<std::mutex> lock(draw_mutex);
+        playing = pos;
+        playing_info = tag;
+        playing_file = file;
+        draw_list();
+        draw_playing();
+      });
+      decoder.decode(track.file, encode, info);
     }
   
     void check_list()
@@ -278,4 +814,4 @@ namespace light::player
     }
   };
 }
-#endif
\ No newline at end of file
+#endif
\ No newline at end of file
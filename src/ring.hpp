@@ -0,0 +1,87 @@
+//   Copyright 2022 light - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef LIGHT_RING_HPP
+#define LIGHT_RING_HPP
+
+#include <atomic>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+namespace light::ring
+{
+  // Lock-free byte ring for exactly one writer thread and one reader thread.
+  class RingBuffer
+  {
+  private:
+    std::vector<unsigned char> buffer;
+    // Total bytes ever written and read, the difference is what is buffered.
+    alignas(64) std::atomic<std::size_t> head;
+    alignas(64) std::atomic<std::size_t> tail;
+  public:
+    explicit RingBuffer(std::size_t capacity) : buffer(capacity), head(0), tail(0) {}
+
+    RingBuffer(const RingBuffer &) = delete;
+
+    std::size_t capacity() const { return buffer.size(); }
+
+    std::size_t size() const
+    {
+      return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+    std::size_t space() const { return capacity() - size(); }
+
+    // Writer side, total bytes ever written.
+    std::size_t written() const { return head.load(std::memory_order_relaxed); }
+
+    // Reader side, drops what was written before `mark`, a value of written().
+    void discard_until(std::size_t mark)
+    {
+      if (mark > tail.load(std::memory_order_relaxed))
+      {
+        tail.store(mark, std::memory_order_release);
+      }
+    }
+
+    // Writer side, returns how many bytes fit.
+    std::size_t write(const void *data, std::size_t n)
+    {
+      auto h = head.load(std::memory_order_relaxed);
+      auto t = tail.load(std::memory_order_acquire);
+      n = std::min(n, capacity() - (h - t));
+      auto pos = h % capacity();
+      auto first = std::min(n, capacity() - pos);
+      memcpy(buffer.data() + pos, data, first);
+      memcpy(buffer.data(), static_cast<const unsigned char *>(data) + first, n - first);
+      head.store(h + n, std::memory_order_release);
+      return n;
+    }
+
+    // Reader side, returns how many bytes were available.
+    std::size_t read(void *dest, std::size_t n)
+    {
+      auto t = tail.load(std::memory_order_relaxed);
+      auto h = head.load(std::memory_order_acquire);
+      n = std::min(n, h - t);
+      auto pos = t % capacity();
+      auto first = std::min(n, capacity() - pos);
+      memcpy(dest, buffer.data() + pos, first);
+      memcpy(static_cast<unsigned char *>(dest) + first, buffer.data(), n - first);
+      tail.store(t + n, std::memory_order_release);
+      return n;
+    }
+  };
+}
+#endif
@@ -15,12 +15,31 @@
 #define LIGHT_STREAM_HPP
 
 #include "audio.hpp"
+#include "ring.hpp"
+#include "uring.hpp"
 #include <memory>
 #include <fstream>
 #include <condition_variable>
 #include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <functional>
+#include <limits>
 #include <vector>
+#include <string>
 #include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <utility>
+#include <algorithm>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace light::stream
 {
@@ -55,6 +74,8 @@ namespace light::stream
   
     virtual void seek_cur_offset(int offset) = 0;
   
+    // The whole stream in memory if it is mapped, nullptr otherwise.
+    virtual const unsigned char *data() const { return nullptr; }
   };
   
   class FileInputStream : public InputStream
@@ -65,26 +86,12 @@ namespace light::stream
   public:
     FileInputStream(std::string fn) : file(std::make_shared<std::fstream>(fn))
     {
-      if (!file->good())
-      {
-        throw logger::Error(LIGHT_ERROR_LOCATION, __func__, "Open file failed.");
-      }
-      file->ignore(std::numeric_limits<std::streamsize>::max());
-      file_size = file->gcount();
-      file->clear();
-      file->seekg(std::ios_base::beg);
+      init();
     }
     
     FileInputStream(std::shared_ptr<std::fstream> f) : file(std::move(f))
     {
-      if (!file->good())
-      {
-        throw logger::Error(LIGHT_ERROR_LOCATION, __func__, "Open file failed.");
-      }
-      file->ignore(std::numeric_limits<std::streamsize>::max());
-      file_size = file->gcount();
-      file->clear();
-      file->seekg(std::ios_base::beg);
+      init();
     }
     
     std::size_t read(unsigned char *dest, std::size_t n) override
@@ -129,58 +136,698 @@ namespace light::stream
         file->seekg(offset, std::ios::cur);
       }
     }
+  
+  private:
+    // Seeking to the end gives the size without reading the file.
+    void init()
+    {
+      if (!file->good())
+      {
+        throw logger::Error(LIGHT_ERROR_LOCATION, __func__, "Open file failed.");
+      }
+      file->seekg(0, std::ios_base::end);
+      file_size = file->tellg();
+      file->seekg(0, std::ios_base::beg);
+      if (!file->good())
+      {
+        throw logger::Error(LIGHT_ERROR_LOCATION, __func__, "Seek file failed.");
+      }
+    }
   };
   
-  class NetInputStream : public InputStream
+  // A local file mapped into memory, which lets a decoder read the
+  // compressed data in place. At least one page of zeros follows the end of
+  // the data, enough for decoders that read past it.
+  class MappedInputStream : public InputStream
   {
   private:
-    std::atomic<bool> written;
-    bool is_end;
-    std::size_t total_size;
-    
-    std::vector<unsigned char> buffer;
-    std::size_t readpos;
+    unsigned char *map;
+    std::size_t map_size;
+    std::size_t file_size;
+    std::size_t pos;
   public:
-    NetInputStream() : written(false), is_end(false), readpos(0) {}
+    MappedInputStream(const std::string &filename) : map(nullptr), map_size(0), file_size(0), pos(0)
+    {
+      int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd == -1)
+      {
+        throw logger::Error(LIGHT_ERROR_LOCATION, __func__, "Open file failed.");
+      }
+      struct stat st;
+      if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+      {
+        close(fd);
+        throw logger::Error(LIGHT_ERROR_LOCATION, __func__, "Not a regular file.");
+      }
+      file_size = st.st_size;
+      std::size_t page = sysconf(_SC_PAGESIZE);
+      map_size = (file_size + page - 1) / page * page + page;
+      // Reserve zeroed memory first and put the file over its beginning.
+      void *p = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p != MAP_FAILED && file_size != 0
+          && mmap(p, file_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+      {
+        munmap(p, map_size);
+        p = MAP_FAILED;
+      }
+      close(fd);
+      if (p == MAP_FAILED)
+      {
+        throw logger::Error(LIGHT_ERROR_LOCATION, __func__, "mmap() failed.");
+      }
+      map = static_cast<unsigned char *>(p);
+      madvise(map, map_size, MADV_SEQUENTIAL);
+      prefetch();
+    }
     
-    std::size_t size() const override
+    MappedInputStream(const MappedInputStream &) = delete;
+    
+    ~MappedInputStream()
     {
-      return total_size;
+      munmap(map, map_size);
+    }
+    
+    std::size_t read(unsigned char *dest, std::size_t n) override
+    {
+      n = std::min(n, file_size - pos);
+      memcpy(dest, map + pos, n);
+      pos += n;
+      return n;
+    }
+    
+    void ignore(std::size_t n) override
+    {
+      pos += std::min(n, file_size - pos);
     }
     
     bool eof() const override
     {
-      return (is_end && unread_size() == 0);
+      return pos >= file_size;
     }
     
-    std::size_t read(unsigned char *dest, std::size_t n) override
+    std::size_t size() const override
     {
-      while (!is_end && unread_size() < n)
+      return file_size;
+    }
+    
+    std::size_t read_size() const override
+    {
+      return pos;
+    }
+    
+    void seek(std::size_t size) override
+    {
+      pos = std::min(size, file_size);
+      prefetch();
+    }
+    
+    void seek_cur_offset(int offset) override
+    {
+      if (offset < 0 && std::size_t(-offset) > pos)
+      {
+        pos = 0;
+      }
+      else
       {
-        wait_for_data();
+        pos = std::min(pos + offset, file_size);
       }
-      std::size_t realsize = n;
-      if (unread_size() < n)
+    }
+    
+    const unsigned char *data() const override
+    {
+      return map;
+    }
+  
+  private:
+    // Start reading the next megabyte before the decoder gets there.
+    void prefetch()
+    {
+      std::size_t page = sysconf(_SC_PAGESIZE);
+      std::size_t begin = pos / page * page;
+      if (begin < file_size)
       {
-        realsize = unread_size();
+        madvise(map + begin, std::min<std::size_t>(1 << 20, file_size - begin), MADV_WILLNEED);
       }
-      memcpy(dest, buffer.data() + readpos, realsize);
-      readpos += realsize;
-      return realsize;
     }
+  };
+  
+  struct ReadAheadStats
+  {
+    std::string backend;
+    unsigned int depth;
+    unsigned int in_flight;
+    std::size_t blocks;
+    // Reads that had to wait for their block.
+    std::size_t stalls;
+  };
   
+  // Reads a local file in blocks and keeps the `depth` blocks from the read
+  // position on in flight, so the decoder consumes one block while the next
+  // ones are being filled. Uses io_uring if the kernel allows it and a few
+  // threads calling pread() otherwise.
+  class ReadAheadInputStream : public InputStream
+  {
+  private:
+    struct Slot
+    {
+      std::vector<unsigned char> data;
+      std::size_t block = 0;
+      std::size_t length = 0;
+      bool done = true;
+      bool failed = false;
+    };
+    
+    int fd;
+    std::size_t file_size;
+    std::size_t pos;
+    std::size_t block_size;
+    // Slot i holds a block b with b % depth == i, blocks [first, first + depth) are requested.
+    std::vector<Slot> slots;
+    std::size_t first;
+    std::unique_ptr<uring::Ring> ring;
+    // The ring exists but the kernel can not read with it.
+    bool ring_unsupported;
+    std::vector<std::thread> workers;
+    std::deque<std::size_t> queue;
+    std::mutex mtx;
+    std::condition_variable cond;
+    bool stopping;
+    std::atomic<unsigned int> in_flight;
+    std::atomic<std::size_t> blocks;
+    std::atomic<std::size_t> stalls;
+  public:
+    ReadAheadInputStream(const std::string &filename, unsigned int depth = 4)
+        : fd(-1), file_size(0), pos(0), block_size(LIGHT_AUDIO_READ_BUFFER_SIZE), slots(std::max(depth, 1u)),
+          first(0), ring_unsupported(false), stopping(false), in_flight(0), blocks(0), stalls(0)
+    {
+      fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+      struct stat st;
+      if (fd == -1 || fstat(fd, &st) == -1)
+      {
+        if (fd != -1) close(fd);
+        throw logger::Error(LIGHT_ERROR_LOCATION, __func__, "Open file failed.");
+      }
+      file_size = st.st_size;
+      posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+      for (auto &slot: slots)
+      {
+        slot.data.resize(block_size);
+      }
+      try
+      {
+        ring = std::make_unique<uring::Ring>(slots.size());
+      }
+      catch (logger::Error &)
+      {
+        start_workers();
+      }
+      restart();
+    }
+    
+    ReadAheadInputStream(const ReadAheadInputStream &) = delete;
+    
+    ~ReadAheadInputStream()
+    {
+      try
+      {
+        drain();
+      }
+      catch (logger::Error &) {}
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+      }
+      cond.notify_all();
+      for (auto &th: workers)
+      {
+        th.join();
+      }
+      close(fd);
+    }
+    
+    std::size_t read(unsigned char *dest, std::size_t n) override
+    {
+      std::size_t length = 0;
+      while (length < n && pos < file_size)
+      {
+        auto b = pos / block_size;
+        auto &slot = wait_for(b);
+        auto offset = pos - b * block_size;
+        auto k = std::min(n - length, slot.length - offset);
+        memcpy(dest + length, slot.data.data() + offset, k);
+        length += k;
+        pos += k;
+        if (offset + k == slot.length)
+        {
+          // The slot is free again, reuse it for the block `depth` ahead.
+          request(b + slots.size());
+          first = b + 1;
+        }
+      }
+      return length;
+    }
+    
     void ignore(std::size_t n) override
     {
-      while (!is_end && unread_size() < n)
+      seek(pos + n);
+    }
+    
+    bool eof() const override
+    {
+      return pos >= file_size;
+    }
+    
+    std::size_t size() const override
+    {
+      return file_size;
+    }
+    
+    std::size_t read_size() const override
+    {
+      return pos;
+    }
+    
+    void seek(std::size_t size) override
+    {
+      pos = std::min(size, file_size);
+      if (pos / block_size != first)
+      {
+        restart();
+      }
+    }
+    
+    void seek_cur_offset(int offset) override
+    {
+      seek(offset < 0 && std::size_t(-offset) > pos ? 0 : pos + offset);
+    }
+    
+    ReadAheadStats stats() const
+    {
+      return ReadAheadStats{
+          .backend = ring != nullptr ? "io_uring" : "threads",
+          .depth = static_cast<unsigned int>(slots.size()),
+          .in_flight = in_flight,
+          .blocks = blocks,
+          .stalls = stalls
+      };
+    }
+  
+  private:
+    void request(std::size_t b)
+    {
+      auto index = b % slots.size();
+      auto &slot = slots[index];
+      slot.block = b;
+      slot.length = b * block_size < file_size ? std::min(block_size, file_size - b * block_size) : 0;
+      slot.failed = false;
+      if (slot.length == 0)
+      {
+        slot.done = true;
+        return;
+      }
+      ++in_flight;
+      ++blocks;
+      if (ring != nullptr)
+      {
+        slot.done = false;
+        ring->read(fd, slot.data.data(), slot.length, b * block_size, index);
+      }
+      else
+      {
+        {
+          std::lock_guard<std::mutex> lock(mtx);
+          slot.done = false;
+          queue.emplace_back(index);
+        }
+        cond.notify_all();
+      }
+    }
+    
+    // Reads what a short read left out, true on success.
+    bool finish(Slot &slot, std::size_t got)
+    {
+      while (got < slot.length)
+      {
+        auto r = pread(fd, slot.data.data() + got, slot.length - got, slot.block * block_size + got);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        got += r;
+      }
+      return true;
+    }
+    
+    void complete(std::size_t index, int res)
+    {
+      auto &slot = slots[index];
+      if (res == -EINVAL || res == -EOPNOTSUPP)
+      {
+        // io_uring before Linux 5.6 has no IORING_OP_READ.
+        ring_unsupported = true;
+        res = 0;
+      }
+      slot.failed = res < 0 || !finish(slot, res);
+      slot.done = true;
+      --in_flight;
+    }
+    
+    Slot &wait_for(std::size_t b)
+    {
+      auto &slot = slots[b % slots.size()];
+      if (ring != nullptr)
+      {
+        if (!slot.done) ++stalls;
+        while (!slot.done)
+        {
+          uint64_t index;
+          int res;
+          ring->wait(index, res);
+          complete(index, res);
+        }
+        if (ring_unsupported) use_threads();
+      }
+      else
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (!slot.done) ++stalls;
+        cond.wait(lock, [&slot] { return slot.done; });
+      }
+      if (slot.failed)
+      {
+        throw logger::Error(LIGHT_ERROR_LOCATION, __func__, "Read file failed.");
+      }
+      return slot;
+    }
+    
+    // Waits for every request, their buffers can not be reused before.
+    void drain()
+    {
+      if (ring != nullptr)
       {
-        wait_for_data();
+        while (in_flight != 0)
+        {
+          uint64_t index;
+          int res;
+          ring->wait(index, res);
+          complete(index, res);
+        }
+        if (ring_unsupported) use_threads();
       }
-      std::size_t realsize = n;
-      if (unread_size() < n)
+      else
       {
-        realsize = unread_size();
+        std::unique_lock<std::mutex> lock(mtx);
+        cond.wait(lock, [this] { return in_flight == 0; });
       }
-      readpos += realsize;
+    }
+    
+    // Finishes what is still queued on the ring and reads with threads from
+    // then on.
+    void use_threads()
+    {
+      while (in_flight != 0)
+      {
+        uint64_t index;
+        int res;
+        ring->wait(index, res);
+        complete(index, res);
+      }
+      ring.reset();
+      start_workers();
+    }
+    
+    void start_workers()
+    {
+      for (std::size_t i = 0; i < std::min<std::size_t>(slots.size(), 4); ++i)
+      {
+        workers.emplace_back([this] { work(); });
+      }
+    }
+    
+    void restart()
+    {
+      drain();
+      first = pos / block_size;
+      for (std::size_t i = 0; i < slots.size(); ++i)
+      {
+        request(first + i);
+      }
+    }
+    
+    void work()
+    {
+      while (true)
+      {
+        std::size_t index;
+        {
+          std::unique_lock<std::mutex> lock(mtx);
+          cond.wait(lock, [this] { return stopping || !queue.empty(); });
+          if (queue.empty()) return;
+          index = queue.front();
+          queue.pop_front();
+        }
+        auto &slot = slots[index];
+        bool ok = finish(slot, 0);
+        {
+          std::lock_guard<std::mutex> lock(mtx);
+          slot.failed = !ok;
+          slot.done = true;
+          --in_flight;
+        }
+        cond.notify_all();
+      }
+    }
+  };
+  
+  struct BufferStats
+  {
+    // Of the track, bits per second, 0 if not known yet.
+    unsigned long bitrate;
+    // Of the download, bytes per second.
+    double throughput;
+    // Bytes there from the read position on.
+    std::size_t buffered;
+    bool buffering;
+    // Reads that found nothing there.
+    std::size_t stalls;
+    // Times the buffer was refilled before it ran out.
+    std::size_t rebuffers;
+    double waited_ms;
+  };
+  
+  // A file that downloads are copied into at the offsets they came from,
+  // remembering which bytes are there.
+  class TeeFile
+  {
+  private:
+    int fd;
+    std::mutex mtx;
+    // Written ranges [first, second), never touching each other.
+    std::map<std::size_t, std::size_t> covered;
+  public:
+    explicit TeeFile(const std::string &filename)
+    {
+      fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      if (fd == -1)
+      {
+        throw logger::Error(LIGHT_ERROR_LOCATION, __func__, "Open file failed.");
+      }
+    }
+    
+    TeeFile(const TeeFile &) = delete;
+    
+    ~TeeFile()
+    {
+      close(fd);
+    }
+    
+    int get_fd() const { return fd; }
+    
+    // Returns false if the bytes could not be written, they stay missing.
+    bool write(const unsigned char *data, std::size_t n, std::size_t offset)
+    {
+      for (std::size_t done = 0; done < n;)
+      {
+        auto written = pwrite(fd, data + done, n - done, offset + done);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        done += written;
+      }
+      cover(offset, offset + n);
+      return true;
+    }
+    
+    // Marks [begin, end) as written by someone else through the fd.
+    void cover(std::size_t begin, std::size_t end)
+    {
+      if (begin >= end) return;
+      std::lock_guard<std::mutex> lock(mtx);
+      auto it = covered.upper_bound(begin);
+      if (it != covered.begin() && std::prev(it)->second >= begin)
+      {
+        --it;
+        begin = it->first;
+      }
+      while (it != covered.end() && it->first <= end)
+      {
+        end = std::max(end, it->second);
+        it = covered.erase(it);
+      }
+      covered.emplace(begin, end);
+    }
+    
+    // The ranges [first, second) of [0, size) not written yet.
+    std::vector<std::pair<std::size_t, std::size_t>> missing(std::size_t size)
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      std::vector<std::pair<std::size_t, std::size_t>> ret;
+      std::size_t pos = 0;
+      for (auto &[begin, end]: covered)
+      {
+        if (begin >= size) break;
+        if (begin > pos) ret.emplace_back(pos, begin);
+        pos = std::max(pos, end);
+      }
+      if (pos < size) ret.emplace_back(pos, size);
+      return ret;
+    }
+  };
+  
+  // Downloaded data is kept in fixed-size chunks that never move, so a
+  // download writes without copying what is already there and the reader
+  // copies out of a chunk without holding any lock. Only looking up, adding
+  // or dropping a chunk takes the mutex.
+  //
+  // Chunks may be sparse: reading where nothing is downloaded and the
+  // current download will not get to soon asks the fetcher for a new ranged
+  // download from there, and writes of the old one are refused from then on.
+  //
+  // With a window set, only that many bytes are kept behind the read
+  // position and a download is told to pause while it is that far ahead, so memory
+  // stays flat for endless streams. Chunks falling out of the window are
+  // dropped, or spilled to a temporary file so that rewinding is local.
+  //
+  // The reader is held back until enough is buffered for the measured
+  // download speed and the bitrate of the track: a little if the download
+  // is faster than playing, otherwise enough that the rest plays through.
+  // Reading with less than half a second left on a slow link refills the
+  // buffer the same way, so there is one pause instead of many stutters.
+  class NetInputStream : public InputStream
+  {
+  public:
+    // Starts a download of everything from `offset` on, whose writes carry
+    // `generation`.
+    using Fetcher = std::function<void(std::size_t offset, std::size_t generation)>;
+  private:
+    static constexpr std::size_t chunk_size = 64 * 1024;
+    // A download at most this far behind a position is waited for.
+    static constexpr std::size_t reach = 4 * chunk_size;
+    // Assumed until the decoder tells the bitrate, in bytes per second.
+    static constexpr double default_byterate = 320000 / 8;
+    static constexpr double min_buffer_seconds = 1;
+    static constexpr double max_buffer_seconds = 60;
+    static constexpr double low_seconds = 0.5;
+    
+    using Clock = std::chrono::steady_clock;
+    
+    struct Chunk
+    {
+      std::unique_ptr<unsigned char[]> data;
+      // Bytes from the beginning of the chunk that are there.
+      std::size_t filled = 0;
+      bool spilled = false;
+    };
+    
+    struct View
+    {
+      const unsigned char *data;
+      std::size_t filled;
+      bool spilled;
+    };
+    
+    std::map<std::size_t, Chunk> chunks;
+    // The chunk the reader copies from, which is never dropped.
+    std::size_t pinned;
+    // Chunks before this one were already dropped or spilled.
+    std::size_t released;
+    std::mutex mtx;
+    // Writes of a stale download may still be running, one at a time.
+    std::mutex write_mutex;
+    std::condition_variable cond;
+    Fetcher fetcher;
+    bool ranges;
+    std::size_t generation;
+    bool download_active;
+    std::size_t download_pos;
+    std::atomic<std::size_t> end_pos;
+    std::atomic<bool> closed;
+    std::atomic<std::size_t> total_size;
+    std::atomic<std::size_t> readpos;
+    std::size_t window;
+    std::atomic<std::size_t> ahead_limit;
+    FILE *spill;
+    std::shared_ptr<TeeFile> tee;
+    // Bytes per second, smoothed, 0 until measured.
+    double throughput;
+    std::size_t sample_bytes;
+    Clock::time_point sample_since;
+    unsigned long bitrate;
+    bool buffering;
+    bool started;
+    Clock::time_point buffering_since;
+    BufferStats buffer_stats;
+  public:
+    NetInputStream() : pinned(0), released(0), ranges(true), generation(0), download_active(false),
+                       download_pos(0), end_pos(std::numeric_limits<std::size_t>::max()), closed(false),
+                       total_size(0), readpos(0), window(0), ahead_limit(0), spill(nullptr), throughput(0), sample_bytes(0),
+                       sample_since(Clock::now()), bitrate(0), buffering(true), started(false),
+                       buffering_since(Clock::now()), buffer_stats{} {}
+    
+    NetInputStream(const NetInputStream &) = delete;
+    
+    ~NetInputStream()
+    {
+      if (spill != nullptr)
+      {
+        fclose(spill);
+      }
+    }
+    
+    std::size_t size() const override
+    {
+      return total_size;
+    }
+    
+    bool eof() const override
+    {
+      return readpos >= end();
+    }
+    
+    std::size_t read(unsigned char *dest, std::size_t n) override
+    {
+      std::size_t length = 0;
+      while (length < n)
+      {
+        std::size_t pos = readpos;
+        View view;
+        if (!acquire(pos, view)) break;
+        auto offset = pos % chunk_size;
+        auto k = std::min(n - length, view.filled - offset);
+        if (!view.spilled)
+        {
+          memcpy(dest + length, view.data + offset, k);
+        }
+        else if (pread(fileno(spill), dest + length, k, pos) != static_cast<ssize_t>(k))
+        {
+          throw logger::Error(LIGHT_ERROR_LOCATION, __func__, "Read spill file failed.");
+        }
+        length += k;
+        readpos = pos + k;
+      }
+      return length;
+    }
+  
+    void ignore(std::size_t n) override
+    {
+      seek(readpos + n);
     }
   
     std::size_t read_size() const override
@@ -188,46 +835,413 @@ namespace light::stream
       return readpos;
     }
   
+    // Data missing at the new position is only waited for by the next read,
+    // which buffers as at the start instead of counting a stall.
     void seek(std::size_t size) override
     {
-      while (!is_end && buffer.size() < size)
-      {
-        wait_for_data();
-      }
-      readpos = size;
+      std::lock_guard<std::mutex> lock(mtx);
+      readpos = std::min(size, end());
+      started = false;
     }
   
     void seek_cur_offset(int offset) override
     {
-      if (offset * -1 >= readpos) { readpos = 0; }
-      else { readpos += offset; }
+      if (offset < 0 && std::size_t(-offset) >= readpos) { seek(0); }
+      else { seek(readpos + offset); }
     }
   
-    auto &get_flag() { return written; }
+    // Keep at most `bytes` behind and ahead of the read position, 0 keeps
+    // everything. Must be set before start().
+    void set_window(std::size_t bytes, bool spill_to_file)
+    {
+      window = bytes;
+      if (window != 0 && spill_to_file)
+      {
+        spill = tmpfile();
+        if (spill == nullptr)
+        {
+          throw logger::Error(LIGHT_ERROR_LOCATION, __func__, "Create spill file failed.");
+        }
+      }
+    }
+    
+    // Downloads pause once they are `bytes` ahead of the reader, 0 for no
+    // limit. Bounds what a song fetched before it plays holds.
+    void set_ahead_limit(std::size_t bytes)
+    {
+      ahead_limit = bytes;
+    }
+    
+    // Bytes downloaded and kept, in memory or spilled.
+    std::size_t held()
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      std::size_t ret = 0;
+      for (auto &[index, chunk]: chunks)
+      {
+        ret += chunk.filled;
+      }
+      return ret;
+    }
+    
+    // Copy everything downloaded into `file` as well, whatever the window.
+    void set_tee(std::shared_ptr<TeeFile> file)
+    {
+      tee = std::move(file);
+    }
+    
+    // Bits per second, used to tell how long the buffer lasts.
+    void set_bitrate(unsigned long bits)
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      bitrate = bits;
+    }
+    
+    BufferStats stats()
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      auto ret = buffer_stats;
+      ret.bitrate = bitrate;
+      ret.throughput = throughput;
+      ret.buffered = ahead(readpos, std::numeric_limits<std::size_t>::max());
+      ret.buffering = buffering;
+      if (buffering)
+      {
+        ret.waited_ms += std::chrono::duration<double, std::milli>(Clock::now() - buffering_since).count();
+      }
+      return ret;
+    }
+    
+    void set_fetcher(Fetcher fetcher_)
+    {
+      fetcher = std::move(fetcher_);
+    }
+    
+    // Starts downloading from the beginning.
+    void start()
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      refetch(0);
+    }
   
     void set_size(const std::size_t size_) { total_size = size_; }
+    
+    // The server sent everything instead of a range, so the download that
+    // asked for one starts over at 0 and no more ranges are asked for.
+    void no_ranges()
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      ranges = false;
+    }
+  
+    // A download ended, the stream ends where the current one stopped.
+    void finish(std::size_t gen)
+    {
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (gen != generation) return;
+        download_active = false;
+        end_pos = download_pos;
+      }
+      cond.notify_all();
+    }
   
-    void set_eof() { is_end = true; };
+    // The reader is gone, the downloads should stop.
+    void close()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        closed = true;
+      }
+      cond.notify_all();
+    }
   
-    void write(unsigned char *arr, std::size_t n)
+    // Returned by write() while the window is full, nothing was taken.
+    static constexpr std::size_t full = std::numeric_limits<std::size_t>::max();
+    
+    // Writes what a download got at `offset`. Returns how many bytes were
+    // taken, 0 once the stream is closed or the download is stale. Never
+    // blocks, so that one loop can drive every download.
+    std::size_t write(const unsigned char *arr, std::size_t n, std::size_t offset, std::size_t gen)
     {
-      auto temp = buffer.size();
-      buffer.resize(buffer.size() + n);
-      memcpy(&buffer[temp], arr, n);
+      std::lock_guard<std::mutex> write_lock(write_mutex);
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (closed || gen != generation) return 0;
+        std::size_t limit = ahead_limit;
+        if ((window != 0 && offset >= readpos + window) || (limit != 0 && offset >= readpos + limit))
+        {
+          // Time spent paused says nothing about the link.
+          sample_bytes = 0;
+          sample_since = Clock::now();
+          return full;
+        }
+      }
+      if (tee != nullptr)
+      {
+        tee->write(arr, n, offset);
+      }
+      release();
+      for (std::size_t done = 0; done < n;)
+      {
+        auto pos = offset + done;
+        auto index = pos / chunk_size;
+        auto begin = pos % chunk_size;
+        auto end = std::min(chunk_size, begin + n - done);
+        unsigned char *data;
+        std::size_t filled;
+        {
+          std::lock_guard<std::mutex> lock(mtx);
+          if (window != 0 && index < released)
+          {
+            // Already out of the window.
+            if (gen == generation) download_pos = index * chunk_size + end;
+            done += end - begin;
+            continue;
+          }
+          auto &chunk = chunks[index];
+          if (chunk.data == nullptr && !chunk.spilled)
+          {
+            chunk.data = std::make_unique<unsigned char[]>(chunk_size);
+          }
+          data = chunk.data.get();
+          filled = chunk.filled;
+        }
+        // Chunks fill from their beginning, what is already there is kept.
+        if (data != nullptr && begin <= filled && filled < end)
+        {
+          memcpy(data + filled, arr + done + (filled - begin), end - filled);
+        }
+        {
+          std::lock_guard<std::mutex> lock(mtx);
+          auto &chunk = chunks[index];
+          if (begin <= chunk.filled)
+          {
+            chunk.filled = std::max(chunk.filled, end);
+          }
+          if (gen == generation)
+          {
+            download_pos = index * chunk_size + end;
+          }
+        }
+        done += end - begin;
+      }
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        measure(n);
+      }
+      cond.notify_all();
+      return n;
     }
 
   private:
-    void wait_for_data()
+    std::size_t end() const
+    {
+      std::size_t total = total_size;
+      return std::min<std::size_t>(end_pos, total != 0 ? total : std::numeric_limits<std::size_t>::max());
+    }
+    
+    // Called with the mutex held.
+    void refetch(std::size_t pos)
+    {
+      if (!fetcher) return;
+      ++generation;
+      download_active = true;
+      download_pos = pos / chunk_size * chunk_size;
+      fetcher(download_pos, generation);
+      cond.notify_all();
+    }
+    
+    // Called with the mutex held.
+    void measure(std::size_t n)
     {
-      while (!written)
+      sample_bytes += n;
+      auto now = Clock::now();
+      auto secs = std::chrono::duration<double>(now - sample_since).count();
+      if (secs < 0.25) return;
+      auto rate = sample_bytes / secs;
+      throughput = throughput == 0 ? rate : 0.7 * throughput + 0.3 * rate;
+      sample_bytes = 0;
+      sample_since = now;
+    }
+    
+    // Bytes there without a hole from `pos` on, counting stops at `limit`.
+    // Called with the mutex held.
+    std::size_t ahead(std::size_t pos, std::size_t limit) const
+    {
+      std::size_t have = 0;
+      auto index = pos / chunk_size;
+      auto offset = pos % chunk_size;
+      for (auto it = chunks.find(index); it != chunks.end() && it->first == index && have < limit; ++it, ++index)
       {
-        std::this_thread::yield();
+        if (it->second.filled <= offset) break;
+        have += it->second.filled - offset;
+        if (it->second.filled < chunk_size) break;
+        offset = 0;
       }
+      return have;
     }
-  
-    std::size_t unread_size() const
+    
+    double byterate() const
     {
-      return buffer.size() - readpos;
+      return bitrate != 0 ? bitrate / 8.0 : default_byterate;
+    }
+    
+    // How much to have from `pos` on before the reader goes on. Called with
+    // the mutex held.
+    std::size_t buffer_target(std::size_t pos) const
+    {
+      auto rate = byterate();
+      double target = min_buffer_seconds * rate;
+      // Until the decoder knows the bitrate, the reader is still at the
+      // tags, so only a little is waited for instead of a whole guess.
+      if (bitrate != 0 && throughput != 0 && throughput < rate * 1.25)
+      {
+        // Playing drains the buffer at `rate - throughput`, it has to last
+        // until the end.
+        std::size_t e = end();
+        double left = e == std::numeric_limits<std::size_t>::max() ? max_buffer_seconds * rate : double(e - pos);
+        target += left * (1 - throughput / rate);
+      }
+      target = std::min(target, max_buffer_seconds * rate);
+      if (window != 0)
+      {
+        target = std::min(target, double(window - std::min(window, 2 * chunk_size)));
+      }
+      return std::max<std::size_t>(target, 1);
+    }
+    
+    // Called with the mutex held.
+    bool buffered_enough(std::size_t pos) const
+    {
+      auto target = buffer_target(pos);
+      auto have = ahead(pos, target);
+      auto next = pos + have;
+      bool coming = download_active && next >= download_pos && next < download_pos + reach;
+      return have >= target || next >= end() || !coming;
+    }
+    
+    // Called with the mutex held.
+    bool running_low(std::size_t pos) const
+    {
+      auto rate = byterate();
+      if (bitrate == 0 || throughput == 0 || throughput >= rate || !download_active) return false;
+      auto low = static_cast<std::size_t>(low_seconds * rate);
+      return ahead(pos, low) < low;
+    }
+    
+    void start_buffering()
+    {
+      buffering = true;
+      buffering_since = Clock::now();
+    }
+    
+    void stop_buffering()
+    {
+      if (!buffering) return;
+      buffering = false;
+      buffer_stats.waited_ms += std::chrono::duration<double, std::milli>(Clock::now() - buffering_since).count();
+    }
+    
+    // Waits until the byte at `pos` is there, and enough after it while
+    // buffering, and pins its chunk. Returns false at the end of the stream.
+    bool acquire(std::size_t &pos, View &view)
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      while (true)
+      {
+        if (pos >= end() || closed)
+        {
+          stop_buffering();
+          return false;
+        }
+        auto index = pos / chunk_size;
+        pinned = index;
+        if (auto it = chunks.find(index); it != chunks.end() && it->second.filled > pos % chunk_size)
+        {
+          if (!buffering && running_low(pos))
+          {
+            start_buffering();
+            ++buffer_stats.rebuffers;
+          }
+          if (!buffering || buffered_enough(pos))
+          {
+            stop_buffering();
+            started = true;
+            view = View{it->second.data.get(), it->second.filled, it->second.spilled};
+            return true;
+          }
+          cond.wait(lock);
+          continue;
+        }
+        if (!buffering)
+        {
+          start_buffering();
+          if (started) ++buffer_stats.stalls;
+        }
+        bool coming = download_active && pos >= download_pos && pos < download_pos + reach;
+        if (!coming)
+        {
+          if (ranges && fetcher)
+          {
+            refetch(pos);
+          }
+          else if (pos < download_pos)
+          {
+            // Dropped and can not be downloaded again.
+            pos = (index + 1) * chunk_size;
+            readpos = pos;
+            continue;
+          }
+        }
+        cond.wait(lock);
+      }
+    }
+    
+    // Drops or spills the chunks out of the window, called by the writer.
+    void release()
+    {
+      if (window == 0) return;
+      std::size_t pos = readpos;
+      std::size_t keep = pos > window ? (pos - window) / chunk_size : 0;
+      std::unique_lock<std::mutex> lock(mtx);
+      std::size_t next = keep;
+      for (auto it = chunks.lower_bound(released); it != chunks.end() && it->first < keep;)
+      {
+        auto index = it->first;
+        auto &chunk = it->second;
+        if (chunk.data == nullptr)
+        {
+          ++it;
+          continue;
+        }
+        if (index == pinned)
+        {
+          next = std::min(next, index);
+          ++it;
+          continue;
+        }
+        if (spill != nullptr && chunk.filled == chunk_size)
+        {
+          // Only this thread frees chunks, so the data stays valid meanwhile.
+          auto data = chunk.data.get();
+          lock.unlock();
+          bool ok = pwrite(fileno(spill), data, chunk_size, index * chunk_size) == chunk_size;
+          lock.lock();
+          if (index == pinned || !ok)
+          {
+            next = std::min(next, index);
+            ++it;
+            continue;
+          }
+          chunk.data.reset();
+          chunk.spilled = true;
+          ++it;
+          continue;
+        }
+        it = chunks.erase(it);
+      }
+      released = next;
     }
   };
   
@@ -245,6 +1259,9 @@ namespace light::stream
     
     virtual void write(const void *data, std::size_t bytes) = 0;
     
+    // Drops what is written but not played yet.
+    virtual void flush() {}
+    
     OutputMode get_mode() { return mode; }
   };
   
@@ -254,7 +1271,7 @@ namespace light::stream
   public:
     FileOutputStream(std::string fn) : OutputStream(OutputMode::file), fs(std::move(fn), std::ios::binary)
     {
-      if (fs.good())
+      if (!fs.good())
       {
         throw logger::Error(LIGHT_ERROR_LOCATION, __func__, "Open file failed.");
       }
@@ -268,27 +1285,232 @@ namespace light::stream
     std::ofstream &native_handle() { return fs; }
   };
   
+  struct AudioStats
+  {
+    std::size_t underruns;
+    std::size_t overruns;
+    unsigned int buffered_ms;
+    unsigned int buffer_ms;
+  };
+  
+  // Decoded PCM goes through a lock-free ring to a thread that feeds
+  // PulseAudio, so a blocking write never stalls the decoder and a slow
+  // input is absorbed by the ring.
   class AudioOutputStream : public OutputStream
   {
   private:
     audio::Audio audio;
+    std::unique_ptr<ring::RingBuffer> ring;
+    std::thread th;
+    std::mutex mtx;
+    std::condition_variable cond;
+    std::mutex audio_mutex;
+    std::atomic<bool> running;
+    std::atomic<bool> paused;
+    // Set while data is expected, an empty ring then counts as an underrun.
+    std::atomic<bool> active;
+    std::atomic<bool> reader_waiting;
+    std::atomic<bool> writer_waiting;
+    std::atomic<std::size_t> underruns;
+    std::atomic<std::size_t> overruns;
+    std::atomic<unsigned int> rate;
+    // written() of the ring when flush() was called, 0 for none.
+    std::atomic<std::size_t> flush_mark;
+    unsigned int buffer_ms;
+    std::exception_ptr error;
   public:
-    AudioOutputStream() : OutputStream(OutputMode::audio) {}
+    AudioOutputStream(unsigned int buffer_ms_ = 500)
+        : OutputStream(OutputMode::audio), running(false), paused(false), active(false),
+          reader_waiting(false), writer_waiting(false), underruns(0), overruns(0),
+          rate(44100), flush_mark(0), buffer_ms(buffer_ms_) {}
+    
+    ~AudioOutputStream()
+    {
+      if (light_is_running) drain();
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        running = false;
+      }
+      cond.notify_all();
+      if (th.joinable())
+      {
+        th.join();
+      }
+    }
     
     void write(const void *data, std::size_t bytes) override
     {
-      audio.write(data, bytes);
+      start();
+      active = true;
+      auto p = static_cast<const unsigned char *>(data);
+      bool waited = false;
+      while (bytes != 0)
+      {
+        auto n = ring->write(p, std::min(bytes, limit() - std::min(limit(), ring->size())));
+        p += n;
+        bytes -= n;
+        wake(reader_waiting);
+        if (bytes == 0) break;
+        if (!waited)
+        {
+          ++overruns;
+          waited = true;
+        }
+        wait(writer_waiting, [this] { return ring->size() < limit() || !running || error; });
+        if (error) std::rethrow_exception(error);
+        if (!running) return;
+      }
     }
     
     void set_audio_server(const std::string &server)
     {
+      std::lock_guard<std::mutex> lock(audio_mutex);
       audio.set_server(server);
       audio.init();
     }
     
-    void set_samplerate(unsigned int rate)
+    void set_samplerate(unsigned int rate_)
+    {
+      if (audio.is_inited() && audio.get_samplerate() == rate_) return;
+      // Everything queued must be played at the old rate first.
+      drain();
+      std::lock_guard<std::mutex> lock(audio_mutex);
+      audio.set_samplerate(rate_);
+      rate = rate_;
+    }
+    
+    // Only takes effect before the first write.
+    void set_buffer_time(unsigned int ms)
+    {
+      buffer_ms = ms;
+    }
+    
+    // Blocks until everything queued has been handed to PulseAudio. Until
+    // the next write, running empty is not counted as an underrun.
+    void drain()
+    {
+      active = false;
+      if (ring == nullptr) return;
+      wait(writer_waiting, [this] { return ring->size() == 0 || !running || error; });
+    }
+    
+    // Called by the decoder when it seeks, so that the audio queued from the
+    // old position is not heard after the new one.
+    void flush() override
+    {
+      if (ring == nullptr) return;
+      flush_mark = ring->written();
+      wake(reader_waiting);
+    }
+    
+    void pause()
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      paused = true;
+    }
+    
+    void go()
     {
-      audio.set_samplerate(rate);
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        paused = false;
+      }
+      cond.notify_all();
+    }
+    
+    AudioStats stats() const
+    {
+      unsigned int r = rate;
+      return AudioStats{
+          .underruns = underruns,
+          .overruns = overruns,
+          .buffered_ms = ring == nullptr ? 0 : static_cast<unsigned int>(ring->size() * 1000 / (r * 4)),
+          .buffer_ms = buffer_ms
+      };
+    }
+  
+  private:
+    // S16 stereo.
+    std::size_t limit() const
+    {
+      return std::min(ring->capacity(), std::max<std::size_t>(std::size_t(rate) * 4 * buffer_ms / 1000 / 4 * 4, 8192));
+    }
+    
+    void start()
+    {
+      if (ring != nullptr) return;
+      // Big enough for the largest common rate.
+      ring = std::make_unique<ring::RingBuffer>(std::size_t(192000) * 4 * buffer_ms / 1000 + 8192);
+      running = true;
+      th = std::thread([this] { run(); });
+    }
+    
+    template<typename Pred>
+    void wait(std::atomic<bool> &waiting, Pred pred)
+    {
+      waiting = true;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      std::unique_lock<std::mutex> lock(mtx);
+      cond.wait(lock, pred);
+      waiting = false;
+    }
+    
+    void wake(std::atomic<bool> &waiting)
+    {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (waiting)
+      {
+        {
+          std::lock_guard<std::mutex> lock(mtx);
+        }
+        cond.notify_all();
+      }
+    }
+    
+    void run()
+    {
+      std::vector<unsigned char> period(4096);
+      while (running)
+      {
+        if (paused)
+        {
+          std::unique_lock<std::mutex> lock(mtx);
+          cond.wait(lock, [this] { return !paused || !running; });
+          continue;
+        }
+        if (auto mark = flush_mark.exchange(0); mark != 0)
+        {
+          ring->discard_until(mark);
+          {
+            std::lock_guard<std::mutex> lock(audio_mutex);
+            audio.flush();
+          }
+          wake(writer_waiting);
+        }
+        if (ring->size() == 0)
+        {
+          if (active) ++underruns;
+          wait(reader_waiting, [this] { return ring->size() != 0 || paused || !running; });
+          continue;
+        }
+        auto n = ring->read(period.data(), period.size());
+        wake(writer_waiting);
+        try
+        {
+          std::lock_guard<std::mutex> lock(audio_mutex);
+          audio.write(period.data(), n);
+        }
+        catch (...)
+        {
+          {
+            std::lock_guard<std::mutex> lock(mtx);
+            error = std::current_exception();
+            running = false;
+          }
+          cond.notify_all();
+          return;
+        }
+      }
     }
   };
 }
@@ -12,118 +12,133 @@
 //   See the License for the specific language governing permissions and
 //   limitations under the License.
 
+#include "mpeg.hpp"
 #include "stream.hpp"
-#include "utils.hpp"
 #include "logger.hpp"
 
-#include <cstdio>
 #include <array>
+#include <deque>
 #include <vector>
-#include <locale>
 #include <string>
-#include <codecvt>
+#include <string_view>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #ifndef LIGHT_TAGREADER_HPP
 #define LIGHT_TAGREADER_HPP
 namespace light::tagreader
 {
-  struct ID3v2Header
-  {
-    std::array<char, 3> header;
-    char version;
-    char revision;
-    char flag;
-    std::array<char, 4> size;
-  };
+  constexpr std::string_view audio_encryption = "AENC";
+  constexpr std::string_view attached_picture = "APIC";
+  constexpr std::string_view comments = "COMM";
+  constexpr std::string_view commercial_frame = "COMR";
+  constexpr std::string_view encryption_method_registration = "ENCR";
+  constexpr std::string_view equalization = "EQUA";
+  constexpr std::string_view event_timing_codes = "ETCO";
+  constexpr std::string_view general_encapsulated_object = "GEOB";
+  constexpr std::string_view group_identification_registration = "GRID";
+  constexpr std::string_view involved_people_list = "IPLS";
+  constexpr std::string_view linked_information = "LINK";
+  constexpr std::string_view music_CD_identifier = "MCDI";
+  constexpr std::string_view MPEG_location_lookup_table = "MLLT";
+  constexpr std::string_view ownership_frame = "OWNE";
+  constexpr std::string_view private_frame = "PRIV";
+  constexpr std::string_view play_counter = "PCNT";
+  constexpr std::string_view popularimeter = "POPM";
+  constexpr std::string_view position_synchronisation_frame = "POSS";
+  constexpr std::string_view recommended_buffer_size = "RBUF";
+  constexpr std::string_view relative_volume_adjustment = "RVAD";
+  constexpr std::string_view reverb = "RVRB";
+  constexpr std::string_view synchronized_lyric_or_text = "SYLT";
+  constexpr std::string_view synchronized_tempo_codes = "SYTC";
+  constexpr std::string_view album_or_movie_or_show_title = "TALB";
+  constexpr std::string_view beats_per_minute = "TBPM";
+  constexpr std::string_view BPM = "TBPM";
+  constexpr std::string_view composer = "TCOM";
+  constexpr std::string_view content_type = "TCON";
+  constexpr std::string_view copyright_message = "TCOP";
+  constexpr std::string_view playlist_delay = "TDLY";
+  constexpr std::string_view encoded_by = "TENC";
+  constexpr std::string_view lyricistor_or_text_writer = "TEXT";
+  constexpr std::string_view file_type = "TFLT";
+  constexpr std::string_view date = "TDAT";
+  constexpr std::string_view time = "TIME";
+  constexpr std::string_view content_group_description = "TIT1";
+  constexpr std::string_view title_or_songname_or_content_description = "TIT2";
+  constexpr std::string_view subtitle_or_description_refinement = "TIT3";
+  constexpr std::string_view initial_key = "TKEY";
+  constexpr std::string_view language = "TLAN";
+  constexpr std::string_view length = "TLEN";
+  constexpr std::string_view media_type = "TMED";
+  constexpr std::string_view original_album_movie_show_title = "TOAL";
+  constexpr std::string_view original_filename = "TOFN";
+  constexpr std::string_view original_lyricist_or_text_writer = "TOLY";
+  constexpr std::string_view original_artist_or_performer = "TOPE";
+  constexpr std::string_view original_release_year = "TORY";
+  constexpr std::string_view file_owner_or_licensee = "TOWN";
+  constexpr std::string_view lead_performer_or_soloist = "TPE1";
+  constexpr std::string_view band_or_orchestra_or_accompaniment = "TPE2";
+  constexpr std::string_view conductor_or_performer_refinement = "TPE3";
+  constexpr std::string_view interpreted_remixed_or_otherwise_modified_by = "TPE4";
+  constexpr std::string_view part_of_a_set = "TPOS";
+  constexpr std::string_view publisher = "TPUB";
+  constexpr std::string_view track_number_or_position_in_set = "TRCK";
+  constexpr std::string_view recording_dates = "TRDA";
+  constexpr std::string_view internet_radio_station_name = "TRSN";
+  constexpr std::string_view internet_radio_station_owner = "TRSO";
+  constexpr std::string_view size = "TSIZ";
+  constexpr std::string_view international_standard_recording_code = "TSRC";
+  constexpr std::string_view ISRC = "TSRC";
+  constexpr std::string_view software_or_hardware_and_settings_used_for_encoding = "TSSE";
+  constexpr std::string_view year = "TYER";
+  constexpr std::string_view user_defined_text_information_frame = "TXXX";
+  constexpr std::string_view unique_file_identifier = "UFID";
+  constexpr std::string_view terms_of_use = "USER";
+  constexpr std::string_view unsychronized_lyric_text_transcription = "USLT";
+  constexpr std::string_view commercial_information = "WCOM";
+  constexpr std::string_view copyright_or_legal_information = "WCOP";
+  constexpr std::string_view official_audio_file_webpage = "WOAF";
+  constexpr std::string_view official_artist_or_performer_webpage = "WOAR";
+  constexpr std::string_view official_audio_source_webpage = "WOAS";
+  constexpr std::string_view official_internet_radio_station_homepage = "WORS";
+  constexpr std::string_view payment = "WPAY";
+  constexpr std::string_view publishers_official_webpage = "WPUB";
+  constexpr std::string_view user_defined_URL_link_frame = "WXXX";
   
-  struct ID3v2Frame
-  {
-    std::array<char, 4> frame_id;
-    std::array<char, 4> size;
-    std::array<char, 2> flags;
-  };
-  const std::string audio_encryption = "AENC";
-  const std::string attached_picture = "APIC";
-  const std::string comments = "COMM";
-  const std::string commercial_frame = "COMR";
-  const std::string encryption_method_registration = "ENCR";
-  const std::string equalization = "EQUA";
-  const std::string event_timing_codes = "ETCO";
-  const std::string general_encapsulated_object = "GEOB";
-  const std::string group_identification_registration = "GRID";
-  const std::string involved_people_list = "IPLS";
-  const std::string linked_information = "LINK";
-  const std::string music_CD_identifier = "MCDI";
-  const std::string MPEG_location_lookup_table = "MLLT";
-  const std::string ownership_frame = "OWNE";
-  const std::string private_frame = "PRIV";
-  const std::string play_counter = "PCNT";
-  const std::string popularimeter = "POPM";
-  const std::string position_synchronisation_frame = "POSS";
-  const std::string recommended_buffer_size = "RBUF";
-  const std::string relative_volume_adjustment = "RVAD";
-  const std::string reverb = "RVRB";
-  const std::string synchronized_lyric_or_text = "SYLT";
-  const std::string synchronized_tempo_codes = "SYTC";
-  const std::string album_or_movie_or_show_title = "TALB";
-  const std::string beats_per_minute = "TBPM";
-  const std::string BPM = "TBPM";
-  const std::string composer = "TCOM";
-  const std::string content_type = "TCON";
-  const std::string copyright_message = "TCOP";
-  const std::string playlist_delay = "TDLY";
-  const std::string encoded_by = "TENC";
-  const std::string lyricistor_or_text_writer = "TENC";
-  const std::string file_type = "TFLT";
-  const std::string time = "TIME";
-  const std::string content_group_description = "TIT1";
-  const std::string title_or_songname_or_content_description = "TIT2";
-  const std::string subtitle_or_description_refinement = "TIT3";
-  const std::string initial_key = "TKEY";
-  const std::string language = "TLAN";
-  const std::string length = "TLEN";
-  const std::string media_type = "TMED";
-  const std::string original_album_movie_show_title = "TOAL";
-  const std::string original_filename = "TOFN";
-  const std::string original_lyricist_or_text_writer = "TOLY";
-  const std::string original_artist_or_performer = "TOPE";
-  const std::string original_release_year = "TORY";
-  const std::string file_owner_or_licensee = "TOWN";
-  const std::string lead_performer_or_soloist = "TPE1";
-  const std::string band_or_orchestra_or_accompaniment = "TPE2";
-  const std::string conductor_or_performer_refinement = "TPE3";
-  const std::string interpreted_remixed_or_otherwise_modified_by = "TPE4";
-  const std::string part_of_a_set = "TPOS";
-  const std::string publisher = "TPUB";
-  const std::string track_number_or_position_in_set = "TRCK";
-  const std::string recording_dates = "TRDA";
-  const std::string internet_radio_station_name = "TRSN";
-  const std::string internet_radio_station_owner = "TRSO";
-  const std::string size = "TSIZ";
-  const std::string international_standard_recording_code = "TSRC";
-  const std::string ISRC = "TSRC";
-  const std::string software_or_hardware_and_settings_used_for_encoding = "TSSE";
-  const std::string year = "TYER";
-  const std::string user_defined_text_information_frame = "TXXX";
-  const std::string unique_file_identifier = "UFID";
-  const std::string terms_of_use = "USER";
-  const std::string unsychronized_lyric_text_transcription = "USLT";
-  const std::string commercial_information = "WCOM";
-  const std::string copyright_or_legal_information = "WCOP";
-  const std::string official_audio_file_webpage = "WOAF";
-  const std::string official_artist_or_performer_webpage = "WOAR";
-  const std::string official_audio_source_webpage = "WOAS";
-  const std::string official_internet_radio_station_homepage = "WORS";
-  const std::string payment = "WPAY";
-  const std::string publishers_official_webpage = "WPUB";
-  const std::string user_defined_URL_link_frame = "WXXX";
-  
-  std::array<std::string, 75> ids{
+  // ID3v2.4
+  constexpr std::string_view audio_seek_point_index = "ASPI";
+  constexpr std::string_view equalisation_2 = "EQU2";
+  constexpr std::string_view relative_volume_adjustment_2 = "RVA2";
+  constexpr std::string_view seek_frame = "SEEK";
+  constexpr std::string_view signature_frame = "SIGN";
+  constexpr std::string_view encoding_time = "TDEN";
+  constexpr std::string_view original_release_time = "TDOR";
+  constexpr std::string_view recording_time = "TDRC";
+  constexpr std::string_view release_time = "TDRL";
+  constexpr std::string_view tagging_time = "TDTG";
+  constexpr std::string_view involved_people = "TIPL";
+  constexpr std::string_view musician_credits_list = "TMCL";
+  constexpr std::string_view mood = "TMOO";
+  constexpr std::string_view produced_notice = "TPRO";
+  constexpr std::string_view album_sort_order = "TSOA";
+  constexpr std::string_view performer_sort_order = "TSOP";
+  constexpr std::string_view title_sort_order = "TSOT";
+  constexpr std::string_view set_subtitle = "TSST";
+
+  // Sorted, so that all_info() keeps the order of the frame IDs.
+  constexpr std::array<std::string_view, 92> ids{
       "AENC",
       "APIC",
+      "ASPI",
       "COMM",
       "COMR",
       "ENCR",
+      "EQU2",
       "EQUA",
       "ETCO",
       "GEOB",
@@ -133,33 +148,44 @@ namespace light::tagreader
       "MCDI",
       "MLLT",
       "OWNE",
-      "PRIV",
       "PCNT",
       "POPM",
       "POSS",
+      "PRIV",
       "RBUF",
+      "RVA2",
       "RVAD",
       "RVRB",
+      "SEEK",
+      "SIGN",
       "SYLT",
       "SYTC",
       "TALB",
       "TBPM",
-      "TBPM",
       "TCOM",
       "TCON",
       "TCOP",
+      "TDAT",
+      "TDEN",
       "TDLY",
+      "TDOR",
+      "TDRC",
+      "TDRL",
+      "TDTG",
       "TENC",
-      "TENC",
+      "TEXT",
       "TFLT",
       "TIME",
+      "TIPL",
       "TIT1",
       "TIT2",
       "TIT3",
       "TKEY",
       "TLAN",
       "TLEN",
+      "TMCL",
       "TMED",
+      "TMOO",
       "TOAL",
       "TOFN",
       "TOLY",
@@ -171,17 +197,21 @@ namespace light::tagreader
       "TPE3",
       "TPE4",
       "TPOS",
+      "TPRO",
       "TPUB",
       "TRCK",
       "TRDA",
       "TRSN",
       "TRSO",
       "TSIZ",
-      "TSRC",
+      "TSOA",
+      "TSOP",
+      "TSOT",
       "TSRC",
       "TSSE",
-      "TYER",
+      "TSST",
       "TXXX",
+      "TYER",
       "UFID",
       "USER",
       "USLT",
@@ -196,109 +226,450 @@ namespace light::tagreader
       "WXXX",
   };
   
-  class TagInfo
+  constexpr uint32_t frame_key(const char *id)
   {
-  private:
-    std::map<std::string, std::string> tags;
-  public:
-    TagInfo(std::shared_ptr<stream::InputStream> input)
+    return (uint32_t(uint8_t(id[0])) << 24) | (uint32_t(uint8_t(id[1])) << 16)
+           | (uint32_t(uint8_t(id[2])) << 8) | uint32_t(uint8_t(id[3]));
+  }
+  
+  constexpr unsigned int hash_bits = 10;
+  
+  constexpr uint32_t frame_hash(uint32_t key, uint32_t multiplier)
+  {
+    return (key * multiplier) >> (32 - hash_bits);
+  }
+  
+  // A multiplier that gives every ID in `ids` its own slot, 0 if none.
+  constexpr uint32_t find_multiplier()
+  {
+    for (uint32_t multiplier = 0x9e3779b1; multiplier < 0x9e3779b1 + 20000; multiplier += 2)
     {
-      ID3v2Header header;
-      
-      input->read(reinterpret_cast<unsigned char *>(&header), sizeof(ID3v2Header));
-      if (std::string(header.header.data(), 3) != "ID3")
+      std::array<bool, 1 << hash_bits> used{};
+      bool ok = true;
+      for (auto id: ids)
       {
-        return;
+        auto h = frame_hash(frame_key(id.data()), multiplier);
+        if (used[h])
+        {
+          ok = false;
+          break;
+        }
+        used[h] = true;
       }
+      if (ok) return multiplier;
+    }
+    return 0;
+  }
+  
+  constexpr uint32_t multiplier = find_multiplier();
+  static_assert(multiplier != 0, "No perfect hash for the frame IDs.");
+  
+  // Index in `ids` plus one, 0 for an empty slot.
+  constexpr std::array<uint8_t, 1 << hash_bits> make_slots()
+  {
+    std::array<uint8_t, 1 << hash_bits> slots{};
+    for (std::size_t i = 0; i < ids.size(); ++i)
+    {
+      slots[frame_hash(frame_key(ids[i].data()), multiplier)] = uint8_t(i + 1);
+    }
+    return slots;
+  }
+  
+  constexpr std::array<uint8_t, 1 << hash_bits> slots = make_slots();
+  
+  // Index of `id` in `ids`, or -1 if it is not a known frame ID.
+  constexpr int find_id(std::string_view id)
+  {
+    if (id.size() != 4) return -1;
+    auto slot = slots[frame_hash(frame_key(id.data()), multiplier)];
+    if (slot == 0 || ids[slot - 1] != id) return -1;
+    return slot - 1;
+  }
+  
+  struct Frame
+  {
+    std::string_view id;
+    const unsigned char *data;
+    std::size_t size;
+    // A 0x00 follows each 0xff in `data` and has to be dropped.
+    bool unsynchronised;
+  };
+  
+  // Drops the 0x00 after each 0xff in place, returns the new size.
+  std::size_t resync(unsigned char *p, std::size_t n)
+  {
+    std::size_t j = 0;
+    for (std::size_t i = 0; i < n; ++i)
+    {
+      p[j++] = p[i];
+      if (p[i] == 0xff && i + 1 < n && p[i + 1] == 0) ++i;
+    }
+    return j;
+  }
+  
+  uint32_t read_synchsafe(const unsigned char *p)
+  {
+    return (uint32_t(p[0] & 0x7f) << 21) | (uint32_t(p[1] & 0x7f) << 14) | (uint32_t(p[2] & 0x7f) << 7)
+           | uint32_t(p[3] & 0x7f);
+  }
+  
+  // Calls `func` with each frame of the ID3v2.3/2.4 tag at `p`, in place.
+  // Compressed and encrypted frames are skipped. A v2.3 tag unsynchronised
+  // as a whole must have been resync()ed after its header first. Returns the
+  // size of the tag, 0 if there is none.
+  template<typename Func>
+  std::size_t for_each_frame(const unsigned char *p, std::size_t n, Func &&func)
+  {
+    std::size_t size = mpeg::id3v2_size(p, n);
+    if (size == 0) return 0;
+    unsigned int version = p[3];
+    unsigned int flags = p[5];
+    if (version != 3 && version != 4) return size;
+    std::size_t end = std::min(n, size - ((flags & 0x10) ? 10 : 0));
+    std::size_t pos = 10;
+    if (flags & 0x40)
+    {
+      if (pos + 4 > end) return size;
+      pos += version == 4 ? read_synchsafe(p + pos) : mpeg::read_be32(p + pos) + 4;
+    }
+    while (pos + 10 <= end && p[pos] != 0)
+    {
+      std::string_view id(reinterpret_cast<const char *>(p + pos), 4);
+      std::size_t length = version == 4 ? read_synchsafe(p + pos + 4) : mpeg::read_be32(p + pos + 4);
+      unsigned int format = p[pos + 9];
+      const unsigned char *data = p + pos + 10;
+      pos += 10;
+      if (length > end - pos) break;
+      pos += length;
       
-      std::size_t tag_size = (header.size[0] & 0x7f) * 0x200000
-                             + (header.size[1] & 0x7f) * 0x400
-                             + (header.size[2] & 0x7f) * 0x40
-                             + (header.size[3] & 0x7f);
-      
-      ID3v2Frame frame;
-      std::size_t bitscount = 0;
-      std::wstring_convert<std::codecvt_utf8<char16_t>, char16_t> converter;
-      while (bitscount < tag_size - sizeof(ID3v2Header))
+      if (version == 3)
       {
-        bitscount += input->read(reinterpret_cast<unsigned char *>(&frame), sizeof(ID3v2Frame));
-        
-        std::size_t size = frame.size[0] * 0x10000000
-                           + frame.size[1] * 0x10000 + frame.size[2] * 0x100 + frame.size[3];
-        
-        std::string id(frame.frame_id.data(), 4);
-        if (size != 0 && id != attached_picture && std::find(ids.begin(), ids.end(), id) != ids.end())
+        if (format & 0xc0) continue;
+        if (format & 0x20)
         {
-          std::size_t encoding = 0;
-          bitscount += input->read(reinterpret_cast<unsigned char *>(&encoding), 1);
-          // 0 -> GBK | 1 -> UTF-16 | 2 -> UTF-16BE | 3 -> UTF-8
-          if (encoding == 0)//GBK
-          {
-            std::vector<char> show;
-            show.resize((size - 1) / sizeof(char));
-            bitscount += input->read(reinterpret_cast<unsigned char *>(show.data()), size - 1);
-            tags[id] = std::string(show.data() + 1, (size - 1) / sizeof(char));
-          }
-          else if (encoding == 1)
-          {
-            std::vector<char16_t> show;
-            show.resize((size - 1) / sizeof(char16_t));
-            bitscount += input->read(reinterpret_cast<unsigned char *>(show.data()), size - 1);
-            tags[id] = converter.to_bytes(std::u16string(show.data(), (size - 1) / sizeof(char16_t)));
-          }
-          else
-          {
-            input->ignore(size - 1);
-          }
+          // Group identifier
+          if (length < 1) continue;
+          ++data;
+          --length;
         }
-        else
+        func(Frame{id, data, length, false});
+        continue;
+      }
+      if (format & 0x0c) continue;
+      if (format & 0x40)
+      {
+        // Group identifier
+        if (length < 1) continue;
+        ++data;
+        --length;
+      }
+      if (format & 0x01)
+      {
+        // Data length indicator
+        if (length < 4) continue;
+        data += 4;
+        length -= 4;
+      }
+      func(Frame{id, data, length, (flags & 0x80) || (format & 0x02)});
+    }
+    return size;
+  }
+  
+  // Appends the UTF-8 form of the `n` UTF-16 code units at `p` to `out`,
+  // up to the first NUL.
+  void utf16_to_utf8(const unsigned char *p, std::size_t n, bool big_endian, std::string &out)
+  {
+    auto unit = [p, big_endian](std::size_t i) -> uint32_t
+    {
+      return big_endian ? (uint32_t(p[2 * i]) << 8) | p[2 * i + 1] : (uint32_t(p[2 * i + 1]) << 8) | p[2 * i];
+    };
+    std::size_t i = 0;
+    while (i < n)
+    {
+#if defined(__SSE2__)
+      // Tags are mostly ASCII, eight code units of it at a time.
+      const __m128i zero = _mm_setzero_si128();
+      const __m128i limit = _mm_set1_epi16(0x80);
+      while (i + 8 <= n)
+      {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 2 * i));
+        if (big_endian)
         {
-          bitscount += size;
-          input->ignore(size);
+          v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
         }
+        __m128i ascii = _mm_and_si128(_mm_cmpgt_epi16(v, zero), _mm_cmplt_epi16(v, limit));
+        if (_mm_movemask_epi8(ascii) != 0xffff) break;
+        char bytes[8];
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(bytes), _mm_packus_epi16(v, v));
+        out.append(bytes, 8);
+        i += 8;
+      }
+      if (i == n) break;
+#endif
+      uint32_t c = unit(i++);
+      if (c == 0) break;
+      if (c >= 0xd800 && c < 0xdc00 && i < n && unit(i) >= 0xdc00 && unit(i) < 0xe000)
+      {
+        c = 0x10000 + ((c - 0xd800) << 10) + (unit(i++) - 0xdc00);
+      }
+      else if (c >= 0xd800 && c < 0xe000)
+      {
+        c = 0xfffd;
+      }
+      
+      if (c < 0x80)
+      {
+        out += char(c);
+      }
+      else if (c < 0x800)
+      {
+        out += char(0xc0 | (c >> 6));
+        out += char(0x80 | (c & 0x3f));
+      }
+      else if (c < 0x10000)
+      {
+        out += char(0xe0 | (c >> 12));
+        out += char(0x80 | ((c >> 6) & 0x3f));
+        out += char(0x80 | (c & 0x3f));
+      }
+      else
+      {
+        out += char(0xf0 | (c >> 18));
+        out += char(0x80 | ((c >> 12) & 0x3f));
+        out += char(0x80 | ((c >> 6) & 0x3f));
+        out += char(0x80 | (c & 0x3f));
       }
     }
+  }
+  
+  std::string_view until_nul(const unsigned char *p, std::size_t n)
+  {
+    auto end = static_cast<const unsigned char *>(memchr(p, 0, n));
+    return {reinterpret_cast<const char *>(p), end == nullptr ? n : std::size_t(end - p)};
+  }
+  
+  // The first string of a text frame. UTF-8 and ISO-8859-1 (which is
+  // often GBK in practice and passed through as is) point into the frame,
+  // UTF-16 is converted into `out`.
+  std::string_view text(const Frame &frame, std::string &out)
+  {
+    const unsigned char *p = frame.data;
+    std::size_t n = frame.size;
+    std::string copy;
+    if (frame.unsynchronised)
+    {
+      copy.assign(reinterpret_cast<const char *>(p), n);
+      n = resync(reinterpret_cast<unsigned char *>(copy.data()), n);
+      p = reinterpret_cast<const unsigned char *>(copy.data());
+    }
+    if (n == 0) return {};
+    // 0 -> ISO-8859-1 | 1 -> UTF-16 | 2 -> UTF-16BE | 3 -> UTF-8
+    auto encoding = p[0];
+    ++p;
+    --n;
+    if (encoding == 1 || encoding == 2)
+    {
+      bool big_endian = encoding == 2;
+      if (encoding == 1 && n >= 2 && ((p[0] == 0xff && p[1] == 0xfe) || (p[0] == 0xfe && p[1] == 0xff)))
+      {
+        big_endian = p[0] == 0xfe;
+        p += 2;
+        n -= 2;
+      }
+      out.clear();
+      utf16_to_utf8(p, n / 2, big_endian, out);
+      return out;
+    }
+    auto ret = until_nul(p, n);
+    if (!frame.unsynchronised) return ret;
+    out.assign(ret);
+    return out;
+  }
+  
+  // The text and URL frames of an ID3v2.3/2.4 tag. The values point into the
+  // tag where they can, so the TagInfo keeps what it was read from. From a
+  // stream only those frames are read, the rest is skipped.
+  class TagInfo
+  {
+  private:
+    // Longer frames are skipped when reading from a stream.
+    static constexpr std::size_t max_frame_size = 64 * 1024;
+    // A v2.3 tag unsynchronised as a whole is read from a stream up to this.
+    static constexpr std::size_t max_whole_size = 1024 * 1024;
     
-    const std::string &operator[](const std::string &tag) const
+    std::shared_ptr<stream::InputStream> input;
+    std::vector<unsigned char> buffer;
+    std::deque<std::string> texts;
+    std::array<std::string_view, ids.size()> values;
+  public:
+    // Reads the tag at the current position and leaves the stream after it,
+    // or where it was if there is none.
+    TagInfo(std::shared_ptr<stream::InputStream> input_) : input(std::move(input_))
     {
-      auto it = tags.find(tag);
-      if (it == tags.end())
+      std::size_t start = input->read_size();
+      if (auto data = input->data(); data != nullptr)
       {
-        throw logger::Error(LIGHT_ERROR_LOCATION, __func__, "Unexpected tag '" + tag + "'.");
+        auto size = parse(data + start, input->size() - start);
+        input->seek(std::min(start + size, input->size()));
+        return;
       }
-      return tags.at(tag);
+      buffer.resize(10);
+      auto n = mpeg::read_full(*input, buffer.data(), buffer.size());
+      auto size = mpeg::id3v2_size(buffer.data(), n);
+      if (size == 0)
+      {
+        input->seek(start);
+        return;
+      }
+      read_frames(size);
     }
     
-    std::string common_info() const
+    // Parses the tag at `p`, which must outlive the TagInfo.
+    TagInfo(const unsigned char *p, std::size_t n)
     {
-      std::string ret;
-      auto it = tags.find(title_or_songname_or_content_description);
-      if (it != tags.end())
+      parse(p, n);
+    }
+    
+    TagInfo(const TagInfo &) = delete;
+    
+    std::string_view operator[](std::string_view tag) const
+    {
+      auto i = find_id(tag);
+      if (i < 0 || values[i].empty())
       {
-        ret += it->second + " - ";
+        throw logger::Error(LIGHT_ERROR_LOCATION, __func__, "Unexpected tag '" + std::string(tag) + "'.");
       }
-      it = tags.find(lead_performer_or_soloist);
-      if (it != tags.end())
+      return values[i];
+    }
+    
+    std::string common_info() const
+    {
+      std::string ret;
+      if (auto title = values[find_id(title_or_songname_or_content_description)]; !title.empty())
       {
-        ret += it->second;
+        ret += std::string(title) + " - ";
       }
+      ret += values[find_id(lead_performer_or_soloist)];
       return ret;
     }
     
-    std::string all_info(const std::vector<std::string> &ignore = {attached_picture, comments}) const
+    std::string all_info(const std::vector<std::string_view> &ignore = {attached_picture, comments}) const
     {
       std::string ret;
-      for (auto it = tags.begin(); it != std::prev(tags.end()); ++it)
+      for (std::size_t i = 0; i < ids.size(); ++i)
+      {
+        if (values[i].empty() || std::find(ignore.begin(), ignore.end(), ids[i]) != ignore.end()) continue;
+        if (!ret.empty()) ret += " - ";
+        ret += values[i];
+      }
+      return ret;
+    }
+  
+  private:
+    // Reads the rest of the tag of `size` whose header is in `buffer`, keeping
+    // the header and the frames parse() uses, and parses them.
+    void read_frames(std::size_t size)
+    {
+      unsigned int version = buffer[3];
+      unsigned int flags = buffer[5];
+      std::size_t pos = 10;
+      if (version == 3 && (flags & 0x80))
       {
-        if (std::find(ignore.begin(), ignore.end(), it->first) != ignore.end()) continue;
-        ret += it->second + " - ";
+        // Has to be resync()ed before the frames can be told apart.
+        auto n = std::min(size, max_whole_size);
+        buffer.resize(n);
+        pos += mpeg::read_full(*input, buffer.data() + pos, n - pos);
+        buffer.resize(pos);
+        input->ignore(size - pos);
+        parse(buffer.data(), buffer.size());
+        return;
       }
-      if (std::find(ignore.begin(), ignore.end(), tags.cbegin()->first) == ignore.end())
+      std::size_t end = size - ((flags & 0x10) ? 10 : 0);
+      if ((version == 3 || version == 4) && (flags & 0x40) && pos + 4 <= end)
       {
-        ret += tags.cbegin()->second;
+        unsigned char ext[4];
+        pos += mpeg::read_full(*input, ext, 4);
+        // The size counts itself in v2.4 only.
+        std::size_t length = version == 4 ? read_synchsafe(ext) : mpeg::read_be32(ext) + std::size_t(4);
+        length = std::min(length - std::min<std::size_t>(length, 4), end - pos);
+        input->ignore(length);
+        pos += length;
+        // Gone from what is kept.
+        buffer[5] &= ~0x40;
       }
-      return ret;
+      while ((version == 3 || version == 4) && pos + 10 <= end)
+      {
+        unsigned char header[10];
+        auto got = mpeg::read_full(*input, header, 10);
+        pos += got;
+        if (got != 10 || header[0] == 0) break;
+        std::size_t length = version == 4 ? read_synchsafe(header + 4) : mpeg::read_be32(header + 4);
+        if (length > end - pos) break;
+        std::string_view id(reinterpret_cast<const char *>(header), 4);
+        bool wanted = (id[0] == 'T' && id != user_defined_text_information_frame)
+                      || (id[0] == 'W' && id != user_defined_URL_link_frame);
+        if (!wanted || length > max_frame_size || find_id(id) < 0)
+        {
+          input->ignore(length);
+          pos += length;
+          continue;
+        }
+        auto at = buffer.size();
+        buffer.insert(buffer.end(), header, header + 10);
+        buffer.resize(at + 10 + length);
+        got = mpeg::read_full(*input, buffer.data() + at + 10, length);
+        pos += got;
+        if (got != length)
+        {
+          buffer.resize(at);
+          break;
+        }
+      }
+      if (pos < size)
+      {
+        input->ignore(size - pos);
+      }
+      parse(buffer.data(), buffer.size());
+    }
+    
+    std::size_t parse(const unsigned char *p, std::size_t n)
+    {
+      std::size_t size = mpeg::id3v2_size(p, n);
+      if (size == 0) return 0;
+      n = std::min(n, size);
+      if (p[3] == 3 && (p[5] & 0x80))
+      {
+        if (p != buffer.data())
+        {
+          buffer.assign(p, p + n);
+        }
+        n = 10 + resync(buffer.data() + 10, n - 10);
+        p = buffer.data();
+      }
+      for_each_frame(p, n, [this](const Frame &frame)
+      {
+        auto i = find_id(frame.id);
+        if (i < 0) return;
+        if (frame.id[0] == 'T' && frame.id != user_defined_text_information_frame)
+        {
+          std::string out;
+          auto value = text(frame, out);
+          values[i] = out.empty() ? value : texts.emplace_back(std::move(out));
+        }
+        else if (frame.id[0] == 'W' && frame.id != user_defined_URL_link_frame)
+        {
+          auto value = until_nul(frame.data, frame.size);
+          if (frame.unsynchronised)
+          {
+            auto &copy = texts.emplace_back(value);
+            copy.resize(resync(reinterpret_cast<unsigned char *>(copy.data()), copy.size()));
+            value = copy;
+          }
+          values[i] = value;
+        }
+      });
+      return size;
     }
   };
 }
-#endif
\ No newline at end of file
+#endif
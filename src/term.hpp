@@ -19,9 +19,20 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/select.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <cerrno>
+#include <signal.h>
 #include <termios.h>
 
 #include <mutex>
+#include <map>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <initializer_list>
 namespace light::term
 {
   class TermPos
@@ -44,12 +55,14 @@ namespace light::term
     struct termios initial_settings, new_settings;
     int peek_character;
     
-    KeyBoard()
+    KeyBoard() : peek_character(-1)
     {
       tcgetattr(0, &initial_settings);
       new_settings = initial_settings;
       tcgetattr(0, &new_settings);
       new_settings.c_lflag &= (~ICANON & ~ECHO);
+      new_settings.c_cc[VMIN] = 1;
+      new_settings.c_cc[VTIME] = 0;
       tcsetattr(0, TCSANOW, &new_settings);
       setbuf(stdin, NULL);
     }
@@ -62,15 +75,9 @@ namespace light::term
     int kbhit()
     {
       unsigned char ch;
-      int nread;
       if (peek_character != -1) return 1;
-      new_settings.c_cc[VMIN] = 0;
-      tcsetattr(0, TCSANOW, &new_settings);
-      nread = read(0, &ch, 1);
-      new_settings.c_cc[VMIN] = 1;
-      tcsetattr(0, TCSANOW, &new_settings);
-  
-      if (nread == 1)
+      struct pollfd pfd{0, POLLIN, 0};
+      if (poll(&pfd, 1, 0) > 0 && read(0, &ch, 1) == 1)
       {
         peek_character = ch;
         return 1;
@@ -80,21 +87,179 @@ namespace light::term
     
     int getch()
     {
-      return getchar();
+      if (peek_character != -1)
+      {
+        int ch = peek_character;
+        peek_character = -1;
+        return ch;
+      }
+      unsigned char ch;
+      return read(0, &ch, 1) == 1 ? ch : -1;
+    }
+  };
+  
+  // Waits for keys on stdin and for signals in one thread, and sleeps
+  // between events. The signals are blocked in the constructor, so it must
+  // be created before any other thread. stdin is left alone until start().
+  class Input
+  {
+  private:
+    int signal_fd;
+    int wake_fd;
+    std::map<int, std::function<void()>> keys;
+    std::map<int, std::function<void()>> signals;
+    std::atomic<bool> running;
+    std::atomic<bool> reading_keys;
+    // Puts the terminal into non-canonical mode while keys are read.
+    std::unique_ptr<KeyBoard> terminal;
+    std::thread th;
+  public:
+    Input(std::initializer_list<int> sigs) : signal_fd(-1), wake_fd(eventfd(0, EFD_CLOEXEC)), running(false),
+                                              reading_keys(false)
+    {
+      sigset_t mask;
+      sigemptyset(&mask);
+      for (auto sig: sigs)
+      {
+        sigaddset(&mask, sig);
+      }
+      pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+      signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    }
+    
+    Input(const Input &) = delete;
+    
+    ~Input()
+    {
+      stop();
+      if (th.joinable())
+      {
+        th.join();
+      }
+      if (signal_fd != -1) close(signal_fd);
+      if (wake_fd != -1) close(wake_fd);
+    }
+    
+    Input &on_key(int key, const std::function<void()> &func)
+    {
+      keys[key] = func;
+      return *this;
+    }
+    
+    Input &on_signal(int sig, const std::function<void()> &func)
+    {
+      signals[sig] = func;
+      return *this;
+    }
+    
+    // Handles the signals only.
+    Input &start_signals()
+    {
+      if (!th.joinable())
+      {
+        running = true;
+        th = std::thread([this] { run(); });
+      }
+      return *this;
+    }
+    
+    // Handles the keys as well.
+    Input &start()
+    {
+      if (terminal == nullptr)
+      {
+        terminal = std::make_unique<KeyBoard>();
+      }
+      reading_keys = true;
+      start_signals();
+      wake();
+      return *this;
+    }
+    
+    void stop()
+    {
+      running = false;
+      wake();
+    }
+  
+  private:
+    void wake()
+    {
+      if (wake_fd != -1)
+      {
+        uint64_t one = 1;
+        [[maybe_unused]] auto ret = write(wake_fd, &one, sizeof(one));
+      }
+    }
+    
+    void run()
+    {
+      struct pollfd fds[3] = {{-1, POLLIN, 0},
+                              {signal_fd, POLLIN, 0},
+                              {wake_fd, POLLIN, 0}};
+      bool stdin_closed = false;
+      while (running)
+      {
+        fds[0].fd = reading_keys && !stdin_closed ? 0 : -1;
+        if (poll(fds, 3, -1) < 0)
+        {
+          if (errno == EINTR) continue;
+          return;
+        }
+        if (fds[0].revents & POLLIN)
+        {
+          unsigned char buf[64];
+          auto n = read(0, buf, sizeof(buf));
+          if (n <= 0)
+          {
+            stdin_closed = true;
+          }
+          for (ssize_t i = 0; i < n && running; ++i)
+          {
+            auto it = keys.find(buf[i]);
+            if (it != keys.end()) it->second();
+          }
+        }
+        else if (fds[0].revents & (POLLHUP | POLLERR | POLLNVAL))
+        {
+          // stdin is closed, only wait for signals from now on.
+          stdin_closed = true;
+        }
+        if (fds[1].revents & POLLIN)
+        {
+          struct signalfd_siginfo info;
+          if (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+          {
+            auto it = signals.find(info.ssi_signo);
+            if (it != signals.end()) it->second();
+          }
+        }
+        if (fds[2].revents & POLLIN)
+        {
+          uint64_t count;
+          [[maybe_unused]] auto ret = read(wake_fd, &count, sizeof(count));
+        }
+      }
     }
   };
   
-  KeyBoard keyboard;
   std::mutex output_mutex;
   
+  // Switches the terminal on first use only.
+  KeyBoard &keyboard()
+  {
+    static KeyBoard kb;
+    return kb;
+  }
+  
   int getch()
   {
-    return keyboard.getch();
+    return keyboard().getch();
   }
   
   bool kbhit()
   {
-    return keyboard.kbhit();
+    return keyboard().kbhit();
   }
   
   std::size_t get_height()
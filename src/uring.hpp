@@ -0,0 +1,175 @@
+//   Copyright 2022 light - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef LIGHT_URING_HPP
+#define LIGHT_URING_HPP
+
+#include "logger.hpp"
+
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define LIGHT_HAS_IO_URING 1
+#endif
+
+namespace light::uring
+{
+#if defined(LIGHT_HAS_IO_URING)
+  // Just enough of io_uring to queue reads and reap their completions, talking
+  // to the kernel directly so that no liburing is needed. Only one thread may
+  // use a Ring at a time.
+  class Ring
+  {
+  private:
+    int fd;
+    void *sq_ptr;
+    void *cq_ptr;
+    std::size_t sq_len;
+    std::size_t cq_len;
+    io_uring_sqe *sqes;
+    std::size_t sqes_len;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    io_uring_cqe *cqes;
+  public:
+    explicit Ring(unsigned int entries) : fd(-1), sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED), sqes(nullptr)
+    {
+      io_uring_params p;
+      memset(&p, 0, sizeof(p));
+      fd = syscall(__NR_io_uring_setup, entries, &p);
+      if (fd < 0)
+      {
+        throw logger::Error(LIGHT_ERROR_LOCATION, __func__,
+                            "io_uring_setup() failed: " + std::string(strerror(errno)));
+      }
+      sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+      cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+      bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+      if (single)
+      {
+        sq_len = cq_len = std::max(sq_len, cq_len);
+      }
+      sq_ptr = mmap(nullptr, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+      cq_ptr = single ? sq_ptr : mmap(nullptr, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                      fd, IORING_OFF_CQ_RING);
+      sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+      void *s = mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+      if (sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || s == MAP_FAILED)
+      {
+        if (s != MAP_FAILED) munmap(s, sqes_len);
+        release();
+        throw logger::Error(LIGHT_ERROR_LOCATION, __func__, "Mapping io_uring failed.");
+      }
+      sqes = static_cast<io_uring_sqe *>(s);
+      auto sq = static_cast<char *>(sq_ptr);
+      auto cq = static_cast<char *>(cq_ptr);
+      sq_tail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+      sq_mask = reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+      sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+      cq_head = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+      cq_tail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+      cq_mask = reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+      cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+    }
+
+    Ring(const Ring &) = delete;
+
+    ~Ring()
+    {
+      if (sqes != nullptr) munmap(sqes, sqes_len);
+      release();
+    }
+
+    // Queues a pread() of `len` bytes at `offset` and submits it.
+    void read(int file, void *buf, unsigned int len, uint64_t offset, uint64_t user_data)
+    {
+      unsigned tail = *sq_tail;
+      unsigned index = tail & *sq_mask;
+      auto sqe = &sqes[index];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = file;
+      sqe->addr = reinterpret_cast<uint64_t>(buf);
+      sqe->len = len;
+      sqe->off = offset;
+      sqe->user_data = user_data;
+      sq_array[index] = index;
+      __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+      while (syscall(__NR_io_uring_enter, fd, 1, 0, 0, nullptr, 0) < 0)
+      {
+        if (errno != EINTR && errno != EAGAIN)
+        {
+          throw logger::Error(LIGHT_ERROR_LOCATION, __func__,
+                              "io_uring_enter() failed: " + std::string(strerror(errno)));
+        }
+      }
+    }
+
+    // Blocks until a request completes, `res` is what read() would return.
+    void wait(uint64_t &user_data, int &res)
+    {
+      while (true)
+      {
+        unsigned head = *cq_head;
+        if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        {
+          auto cqe = &cqes[head & *cq_mask];
+          user_data = cqe->user_data;
+          res = cqe->res;
+          __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+          return;
+        }
+        if (syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR)
+        {
+          throw logger::Error(LIGHT_ERROR_LOCATION, __func__,
+                              "io_uring_enter() failed: " + std::string(strerror(errno)));
+        }
+      }
+    }
+
+  private:
+    void release()
+    {
+      if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_len);
+      if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_len);
+      if (fd >= 0) close(fd);
+    }
+  };
+#else
+  class Ring
+  {
+  public:
+    explicit Ring(unsigned int)
+    {
+      throw logger::Error(LIGHT_ERROR_LOCATION, __func__, "io_uring is not supported.");
+    }
+
+    void read(int, void *, unsigned int, uint64_t, uint64_t) {}
+
+    void wait(uint64_t &, int &) {}
+  };
+#endif
+}
+#endif
@@ -16,6 +16,7 @@
 
 #include <string>
 #include <cstring>
+#include <cstdint>
 #include <malloc.h>
 #include <iostream>
 
@@ -28,6 +29,10 @@ namespace light::utils
     unsigned long bitrate;
     unsigned int channels;
     std::size_t size;
+    // Known only when the stream has a Xing/Info/VBRI header.
+    uint64_t frames;
+    unsigned int encoder_delay;
+    unsigned int encoder_padding;
   };
   
   enum class Color
@@ -0,0 +1,83 @@
+//   Copyright 2022 light - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#include "test.hpp"
+#include "decoder.hpp"
+
+#include <new>
+
+// Heap allocations made by this thread, the decoder runs on it.
+thread_local std::size_t allocations = 0;
+
+void *operator new(std::size_t size)
+{
+  ++allocations;
+  if (void *p = std::malloc(size == 0 ? 1 : size)) return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+  std::free(p);
+}
+
+using namespace light;
+
+// Counts the allocations between consecutive frames once the decoder has
+// warmed up.
+class CountingEncodeStream : public encoder::EncodeStream
+{
+public:
+  std::size_t frames = 0;
+  std::size_t last = 0;
+  std::size_t steady = 0;
+  
+  CountingEncodeStream() : EncodeStream(nullptr) {}
+  
+  void write(const void *, std::size_t) override
+  {
+    if (frames >= 16) steady += allocations - last;
+    last = allocations;
+    ++frames;
+  }
+};
+
+// Decoding a frame must not touch the heap.
+int main()
+{
+  auto path = test::write_temp("alloc.mp3", test::make_mp3(500, 2));
+  for (bool mapped: {false, true})
+  {
+    std::shared_ptr<stream::InputStream> in;
+    if (mapped)
+    {
+      in = std::make_shared<stream::MappedInputStream>(path);
+    }
+    else
+    {
+      in = std::make_shared<stream::FileInputStream>(path);
+    }
+    auto out = std::make_shared<CountingEncodeStream>();
+    decoder::Decoder d;
+    d.decode(in, out, nullptr);
+    LIGHT_CHECK(out->frames > 400);
+    LIGHT_CHECK(out->steady == 0);
+  }
+  std::remove(path.c_str());
+  return 0;
+}
@@ -0,0 +1,90 @@
+//   Copyright 2022 light - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#include "test.hpp"
+#include "stream.hpp"
+
+#include <chrono>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace light;
+
+// Drops the file from the page cache, so the next open reads the disk.
+void evict(const std::string &path)
+{
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return;
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+// Median microseconds to open `path` and learn its size.
+template<typename Open>
+double measure(const std::string &path, bool cold, Open open)
+{
+  std::vector<double> times;
+  for (int i = 0; i < 9; ++i)
+  {
+    if (cold) evict(path);
+    auto begin = std::chrono::steady_clock::now();
+    open();
+    times.emplace_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count());
+  }
+  std::sort(times.begin(), times.end());
+  return times[times.size() / 2];
+}
+
+// Time to open a local file with a cold and a warm page cache. Takes the
+// files to open, or makes files of 1, 16 and 256 MB.
+int main(int argc, char *argv[])
+{
+  std::vector<std::string> paths(argv + 1, argv + argc);
+  std::vector<std::string> made;
+  if (paths.empty())
+  {
+    for (std::size_t mb: {1, 16, 256})
+    {
+      std::vector<unsigned char> data(mb * 1024 * 1024, 0x55);
+      made.emplace_back(test::write_temp("open-" + std::to_string(mb) + ".bin", data));
+    }
+    paths = made;
+  }
+  
+  std::printf("%-40s %8s %12s %12s\n", "file", "cache", "file us", "mapped us");
+  for (auto &path: paths)
+  {
+    for (bool cold: {true, false})
+    {
+      auto file = measure(path, cold, [&path]
+      {
+        stream::FileInputStream in(path);
+        LIGHT_CHECK(in.size() != 0);
+      });
+      auto mapped = measure(path, cold, [&path]
+      {
+        stream::MappedInputStream in(path);
+        LIGHT_CHECK(in.size() != 0);
+      });
+      std::printf("%-40s %8s %12.1f %12.1f\n", path.c_str(), cold ? "cold" : "warm", file, mapped);
+    }
+  }
+  for (auto &path: made)
+  {
+    std::remove(path.c_str());
+  }
+  return 0;
+}
@@ -0,0 +1,60 @@
+//   Copyright 2022 light - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#include "test.hpp"
+#include "decoder.hpp"
+
+using namespace light;
+
+class MemoryEncodeStream : public encoder::EncodeStream
+{
+public:
+  std::vector<short> samples;
+  
+  MemoryEncodeStream() : EncodeStream(nullptr) {}
+  
+  void write(const void *data, std::size_t bytes) override
+  {
+    auto p = static_cast<const short *>(data);
+    samples.insert(samples.end(), p, p + bytes / sizeof(short));
+  }
+};
+
+// ParallelDecoder must give exactly the samples of a sequential decode.
+int main()
+{
+  // A little over three segments, so that every boundary needs the reservoir.
+  auto path = test::write_temp("parallel.mp3", test::make_mp3(3500, 1));
+  
+  auto sequential = std::make_shared<MemoryEncodeStream>();
+  decoder::Decoder d;
+  d.decode(std::make_shared<stream::FileInputStream>(path), sequential, nullptr);
+  LIGHT_CHECK(std::any_of(sequential->samples.begin(), sequential->samples.end(), [](short s) { return s != 0; }));
+  
+  for (bool mapped: {false, true})
+  {
+    for (unsigned int threads: {1, 2, 5})
+    {
+      auto parallel = std::make_shared<MemoryEncodeStream>();
+      decoder::ParallelDecoder p([&path, mapped]() -> std::shared_ptr<stream::InputStream>
+                                 {
+                                   if (mapped) return std::make_shared<stream::MappedInputStream>(path);
+                                   return std::make_shared<stream::FileInputStream>(path);
+                                 }, threads);
+      p.decode(parallel, nullptr);
+      LIGHT_CHECK(parallel->samples == sequential->samples);
+    }
+  }
+  std::remove(path.c_str());
+  return 0;
+}
@@ -0,0 +1,102 @@
+//   Copyright 2022 light - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#include "test.hpp"
+#include "pcm.hpp"
+
+#include <limits>
+
+using namespace light;
+
+// Every conversion kernel must match scale() bit for bit.
+void check(pcm::Kernel kernel, const std::vector<mad_fixed_t> &left, const std::vector<mad_fixed_t> &right)
+{
+  // Odd offsets and lengths reach the unaligned loads and the scalar tails.
+  const std::size_t lengths[] = {0, 1, 7, 8, 9, 15, 16, 17, 31, 33, 576, 1149};
+  for (std::size_t offset: {0, 1, 3})
+  {
+    for (std::size_t n: lengths)
+    {
+      for (unsigned int nchannels: {1, 2})
+      {
+        const mad_fixed_t *channels[2] = {left.data() + offset, right.data() + offset};
+        std::vector<short> out(n * nchannels + 1, 0x5a5a);
+        kernel(channels, nchannels, n, out.data());
+        for (std::size_t i = 0; i < n; ++i)
+        {
+          for (unsigned int c = 0; c < nchannels; ++c)
+          {
+            LIGHT_CHECK(out[i * nchannels + c] == pcm::scale(channels[c][i]));
+          }
+        }
+        LIGHT_CHECK(out.back() == 0x5a5a);
+      }
+    }
+  }
+}
+
+int main()
+{
+  // scale() itself overflows within the rounding offset below the maximum.
+  constexpr mad_fixed_t max = std::numeric_limits<mad_fixed_t>::max() - (1L << (MAD_F_FRACBITS - 16));
+  constexpr mad_fixed_t min = std::numeric_limits<mad_fixed_t>::min();
+  std::vector<mad_fixed_t> edges{0, 1, -1, MAD_F_ONE, -MAD_F_ONE, max, min, min + 1};
+  for (mad_fixed_t v: {MAD_F_ONE, -MAD_F_ONE, mad_fixed_t(1L << (MAD_F_FRACBITS - 16)),
+                       mad_fixed_t(1L << (MAD_F_FRACBITS + 1 - 16))})
+  {
+    for (mad_fixed_t d = -2; d <= 2; ++d)
+    {
+      edges.emplace_back(v + d);
+      edges.emplace_back(-v + d);
+    }
+  }
+  
+  std::mt19937 rand(1);
+  std::uniform_int_distribution<mad_fixed_t> any(min, max);
+  std::normal_distribution<double> audio(0, MAD_F_ONE / 2);
+  std::vector<mad_fixed_t> left(1152), right(1152);
+  for (int round = 0; round < 200; ++round)
+  {
+    for (std::size_t i = 0; i < left.size(); ++i)
+    {
+      if (round == 0)
+      {
+        left[i] = edges[i % edges.size()];
+        right[i] = edges[(i * 7 + 3) % edges.size()];
+      }
+      else if (round % 2 == 0)
+      {
+        left[i] = any(rand);
+        right[i] = any(rand);
+      }
+      else
+      {
+        left[i] = static_cast<mad_fixed_t>(audio(rand));
+        right[i] = static_cast<mad_fixed_t>(audio(rand));
+      }
+    }
+    check(pcm::convert_scalar, left, right);
+#if defined(__SSE2__)
+    check(pcm::convert_sse2, left, right);
+    if (__builtin_cpu_supports("avx2"))
+    {
+      check(pcm::convert_avx2, left, right);
+    }
+#endif
+#if defined(__ARM_NEON)
+    check(pcm::convert_neon, left, right);
+#endif
+    check(pcm::kernel, left, right);
+  }
+  return 0;
+}
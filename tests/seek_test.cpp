@@ -0,0 +1,103 @@
+//   Copyright 2022 light - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#include "test.hpp"
+#include "decoder.hpp"
+
+using namespace light;
+
+// Seeks by `ms` once `at` frames were output and counts the frames.
+class SeekingEncodeStream : public encoder::EncodeStream
+{
+public:
+  decoder::Decoder *decoder;
+  std::size_t at;
+  long ms;
+  long moved = 0;
+  std::size_t frames = 0;
+  
+  SeekingEncodeStream(decoder::Decoder *decoder_, std::size_t at_, long ms_)
+      : EncodeStream(nullptr), decoder(decoder_), at(at_), ms(ms_) {}
+  
+  void write(const void *, std::size_t) override
+  {
+    if (++frames == at) moved = decoder->seek(ms);
+  }
+};
+
+// An index from a Xing table of contents, which is only 1/256 of the size
+// exact.
+index::SeekIndex toc_index(const std::vector<unsigned char> &data, std::size_t frames)
+{
+  mpeg::FrameHeader h;
+  mpeg::parse_header(data.data(), h);
+  mpeg::VBRHeader vbr;
+  vbr.type = mpeg::VBRHeader::Type::xing;
+  vbr.frames = frames;
+  vbr.bytes = data.size();
+  for (std::size_t i = 0; i < 100; ++i)
+  {
+    vbr.xing_toc.emplace_back(i * 256 / 100);
+  }
+  return index::SeekIndex::from_vbr_header(vbr, h, 0);
+}
+
+// Without a seek index a relative seek moves by bytes from the frame that
+// is playing, whatever the input buffered ahead of it.
+int main()
+{
+  constexpr std::size_t total = 1000;
+  auto path = test::write_temp("seek.mp3", test::make_mp3(total, 3));
+  // 5 s at 128 kbps are 80000 bytes, a little less than 192 frames.
+  const std::size_t skipped = 192;
+  for (bool mapped: {false, true})
+  {
+    for (std::size_t at: {50, 100, 400})
+    {
+      std::shared_ptr<stream::InputStream> in;
+      if (mapped)
+      {
+        in = std::make_shared<stream::MappedInputStream>(path);
+      }
+      else
+      {
+        in = std::make_shared<stream::FileInputStream>(path);
+      }
+      decoder::Decoder d;
+      auto out = std::make_shared<SeekingEncodeStream>(&d, at, 5000);
+      d.decode(in, out, std::make_shared<std::promise<utils::MusicInfo>>());
+      // The frames right after the seek lack their bit reservoir.
+      LIGHT_CHECK(out->frames <= total - skipped);
+      LIGHT_CHECK(out->frames >= total - skipped - 4);
+    }
+  }
+  
+  // With a table of contents the seek lands between its points, in the
+  // direction asked for.
+  auto data = test::make_mp3(total, 3);
+  for (long ms: {5000L, -5000L})
+  {
+    decoder::Decoder d;
+    std::promise<index::SeekIndex> promise;
+    promise.set_value(toc_index(data, total));
+    d.set_index(promise.get_future().share());
+    auto out = std::make_shared<SeekingEncodeStream>(&d, 400, ms);
+    d.decode(std::make_shared<stream::MappedInputStream>(path), out,
+             std::make_shared<std::promise<utils::MusicInfo>>());
+    LIGHT_CHECK(out->moved == ms);
+    std::size_t expected = ms > 0 ? total - skipped : total + skipped;
+    LIGHT_CHECK(out->frames + 6 >= expected && out->frames <= expected + 6);
+  }
+  std::remove(path.c_str());
+  return 0;
+}
@@ -0,0 +1,115 @@
+//   Copyright 2022 light - caozhanhao
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+#ifndef LIGHT_TEST_HPP
+#define LIGHT_TEST_HPP
+
+// What main.cpp defines before including the headers.
+extern const int LIGHT_AUDIO_READ_BUFFER_SIZE = 65536;
+
+#include <atomic>
+
+std::atomic<bool> light_is_running = true;
+bool light_output = true;
+
+#include <vector>
+#include <string>
+#include <random>
+#include <fstream>
+#include <filesystem>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+
+#define LIGHT_CHECK(cond) \
+  do { \
+    if (!(cond)) \
+    { \
+      std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      std::exit(1); \
+    } \
+  } while (0)
+
+namespace light::test
+{
+  class BitWriter
+  {
+  private:
+    std::vector<unsigned char> &out;
+    std::size_t bits;
+  public:
+    BitWriter(std::vector<unsigned char> &out_) : out(out_), bits(0) {}
+    
+    void put(uint32_t value, int n)
+    {
+      for (int i = n - 1; i >= 0; --i, ++bits)
+      {
+        if (bits % 8 == 0) out.push_back(0);
+        if ((value >> i) & 1) out.back() |= 0x80 >> (bits % 8);
+      }
+    }
+  };
+  
+  // A 128 kbps 44.1 kHz stereo MPEG-1 Layer III stream of `frames` frames
+  // whose main data is random. With count1 table B every bit string is
+  // valid Huffman data, so it decodes to noise, and from the second frame on
+  // each frame starts 100 bytes back in the bit reservoir.
+  std::vector<unsigned char> make_mp3(std::size_t frames, unsigned int seed)
+  {
+    constexpr std::size_t frame_size = 417;
+    constexpr std::size_t slot = frame_size - 4 - 32;
+    constexpr std::size_t reservoir = 100;
+    std::mt19937 rand(seed);
+    std::vector<unsigned char> main_data(slot * frames);
+    for (auto &c: main_data)
+    {
+      c = rand();
+    }
+    
+    std::vector<unsigned char> ret;
+    for (std::size_t i = 0; i < frames; ++i)
+    {
+      BitWriter w(ret);
+      w.put(0xfffb9000, 32);
+      std::size_t begin = i == 0 ? 0 : reservoir;
+      std::size_t part2_3_length = (i == 0 ? slot - reservoir : slot) * 8 / 4;
+      w.put(begin, 9);
+      w.put(0, 3);
+      w.put(0, 8);
+      for (int granule = 0; granule < 2; ++granule)
+      {
+        for (int channel = 0; channel < 2; ++channel)
+        {
+          w.put(part2_3_length, 12);
+          w.put(0, 9);
+          w.put(150 + rand() % 40, 8);
+          // scalefac_compress, window_switching_flag, table_select,
+          // region0_count, region1_count, preflag, scalefac_scale
+          w.put(0, 4 + 1 + 15 + 4 + 3 + 1 + 1);
+          w.put(1, 1);
+        }
+      }
+      ret.insert(ret.end(), main_data.begin() + i * slot, main_data.begin() + (i + 1) * slot);
+    }
+    return ret;
+  }
+  
+  std::string write_temp(const std::string &name, const std::vector<unsigned char> &data)
+  {
+    auto path = (std::filesystem::temp_directory_path() / ("light-test-" + name)).string();
+    std::ofstream fs(path, std::ios::binary | std::ios::trunc);
+    fs.write(reinterpret_cast<const char *>(data.data()), data.size());
+    return path;
+  }
+}
+#endif